@@ -49,6 +49,7 @@ typedef enum {
 extern osMessageQId  CmdBoxId;
 
 extern void ParseInputChars(uint8_t ch);
+extern void PutUint16(uint16_t value);
 extern void StartMotorThread(void const * argument);
 
 #endif /* __COMMAND_H */
@@ -0,0 +1,55 @@
+/**
+  * COPYRIGHT(c) 2014 Y.Magara
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __PLANNER_H
+#define __PLANNER_H
+#include <stdint.h>
+
+/* Motion profiles and plans. Nothing here depends on the HAL, so the
+   planner can be built and exercised on a host as well. */
+
+// trapezoidal move of one servo
+typedef struct {
+	uint32_t start;
+	uint32_t goal;
+	uint32_t vmax;				// pulse width change per frame
+	uint32_t accel;				// velocity change per frame, in 1/PROFILE_ACCEL_UNIT
+	uint32_t zone;				// distance before the goal run at vzone, 0 for none
+	uint32_t vzone;				// velocity limit inside the zone
+} ProfileDef;
+
+// one move of a motion plan
+typedef struct {
+	int16_t index;				// servo to move
+	uint32_t goal;				// goal position
+	int16_t after;				// earlier step which must clear first, or -1
+	uint32_t clearance;		// travel of the 'after' step before this one starts
+} MotionStepDef;
+
+// clearance value to wait until the 'after' step has stopped
+#define CLEARANCE_STOPPED 0xFFFFFFFFUL
+
+// one beam of a stack to clear, listed from the top
+typedef struct {
+	uint32_t position;		// position when the plan starts
+	ProfileDef profile;		// move to the take position
+} PlanBeamDef;
+
+#define PLAN_MAX_BEAMS 8
+#define PLAN_MAX_FRAMES 3000
+
+// fraction of the accel member, which may be well below a step per frame
+// per frame at high frame rates
+#define PROFILE_ACCEL_UNIT 256
+
+// frame count limit which never cuts a move short
+#define PROFILE_NO_LIMIT 0xFFFFFFFFUL
+
+extern uint32_t ProfileNext(const ProfileDef *profile, uint32_t position);
+extern uint32_t ProfileFrames(const ProfileDef *profile, uint32_t position, uint32_t limit);
+extern void PlanClear(const PlanBeamDef *beam, uint16_t count, uint32_t margin, MotionStepDef *steps);
+extern uint8_t PlanCheck(const PlanBeamDef *beam, uint16_t count, uint32_t margin, const MotionStepDef *steps);
+
+#endif /* __PLANNER_H */
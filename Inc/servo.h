@@ -0,0 +1,167 @@
+/**
+  * COPYRIGHT(c) 2014 Y.Magara
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SERVO_H
+#define __SERVO_H
+#include "stm32f0xx_hal.h"
+#include "tim.h"
+#include "planner.h"
+
+typedef struct {
+	char *name;
+	TIM_HandleTypeDef  *htim_base;
+	uint32_t channel;
+	uint32_t PutPosition;
+	uint32_t TakePosition;
+	uint32_t MaxVelocity;		// pulse width change per frame at SERVO_FRAME_RATE
+	uint32_t Acceleration;	// velocity change per frame at SERVO_FRAME_RATE
+	uint32_t SettleLag;			// settle time in us per us of pulse width moved
+	uint32_t HoldTime;			// ms to keep driving a settled servo, 0 for ever
+	uint32_t HoverOffset;		// distance short of PutPosition to hover at
+	uint32_t ApproachZone;		// distance before PutPosition moved slowly, 0 for none
+	uint32_t ApproachVelocity;	// velocity limit inside the approach zone, as MaxVelocity
+	uint32_t Current;				// mA drawn while moving at MaxVelocity
+	int32_t Backlash;				// overshoot to arrive with rising (>0) or falling (<0) position, 0 for none
+	__IO uint32_t position;
+	__IO uint32_t start;
+	__IO uint32_t goal;
+	__IO uint32_t notify;		// travel to signal the motor thread at, or 0
+	__IO uint32_t vmax;			// MaxVelocity of the current move
+	__IO uint32_t accel;		// Acceleration of the current move
+	__IO uint32_t zone;			// approach zone of the current move
+	__IO uint32_t vzone;		// velocity limit inside the zone
+	__IO uint32_t frames;		// length of a straight move in frames, 0 for a profiled one
+	__IO uint32_t frame;		// frames of the current move run so far
+	__IO uint32_t settle;		// kernel tick (ms) the horn is expected to have settled at
+	__IO uint8_t idle;			// pulses stopped after HoldTime
+} ServoActionDef;
+
+#define NUM_OF_SERVO 5
+
+// 1: advance all servos of a timer from one update interrupt per period,
+//    which is disabled while the timer has no moving servo.
+// 0: advance each servo from its own capture/compare interrupt.
+#define SERVO_USE_UPDATE_IRQ 0
+
+// 1: stream precomputed compare values of each timer by DMA bursts on the
+//    update event (TIM2_UP on DMA1 channel 2, TIM3_UP on channel 3), so no
+//    interrupt runs per frame while servos move.
+#define SERVO_USE_DMA_BURST 0
+
+// 1: spread the pulses over the frame. CH1 and CH3 pulse at the start of
+//    the frame, CH2 and CH4 at its end, and TIM2 runs half a frame behind
+//    TIM3, so at most two arms draw their peak current at once.
+#define SERVO_STAGGER_PHASE 1
+
+#if SERVO_USE_UPDATE_IRQ && SERVO_USE_DMA_BURST
+#error "SERVO_USE_UPDATE_IRQ and SERVO_USE_DMA_BURST are exclusive"
+#endif
+
+// default PWM frame rate of each timer, and its limits. A frame has to
+// hold the longest pulse, and at 50 Hz it just fits the 16-bit TIM3.
+#define SERVO_FRAME_RATE 50
+#define SERVO_FRAME_RATE_MIN 50
+#define SERVO_FRAME_RATE_MAX 333
+
+/* Timers driving servos, TIM2 and TIM3 */
+#define NUM_OF_TIMER 2
+#define TIMER_SLOT(htim) (((uint32_t)(htim)->Instance - TIM2_BASE) >> 10)
+
+// positions are in timer steps of 1/SERVO_TICKS_PER_US us
+#define US2POS(us)      ((us) * SERVO_TICKS_PER_US)
+#define DEG2PULSE(deg)  US2POS(1499+9*(deg))
+
+#define SERVO_NEUTRAL_POS DEG2PULSE(0)
+
+#define CARD_PUT_POS DEG2PULSE(45)
+#define CARD_TAKE_POS DEG2PULSE(-50)
+#define RW_PUT_POS DEG2PULSE(50)
+#define RW_TAKE_POS DEG2PULSE(-45)
+
+#define SERVO_POSITION_MIN US2POS(900)
+#define SERVO_POSITION_MAX US2POS(2100)
+
+#define SERVO_MAX_VELOCITY US2POS(32)
+#define SERVO_ACCELERATION US2POS(8)
+#define SERVO_VELOCITY_LIMIT US2POS(255)
+#define SERVO_SPEED_SCALE_MAX 200
+
+// default lag of the horn behind the pulse width, and its upper limit
+#define SERVO_SETTLE_LAG 50
+#define SERVO_SETTLE_LAG_MAX 1000
+
+// default hold time, 0 keeps pulses on idle servos
+#define SERVO_HOLD_TIME 0
+#define SERVO_HOLD_TIME_MAX 60000
+
+// distance short of the put position an arm waits at (25 degrees)
+#define SERVO_HOVER_OFFSET US2POS(9*25)
+
+// default approach zone, 0 runs the whole move at MaxVelocity
+#define SERVO_APPROACH_ZONE 0
+#define SERVO_APPROACH_VELOCITY US2POS(4)
+
+// default backlash compensation, 0 arrives from either side
+#define SERVO_BACKLASH 0
+#define SERVO_BACKLASH_MAX US2POS(50)
+
+// default current of a moving arm in mA, and its upper limit
+#define SERVO_CURRENT 400
+#define SERVO_CURRENT_MAX 5000
+// default supply current for all moving arms, 0 for no limit
+#define SERVO_CURRENT_BUDGET 0
+
+// soft start: pulses every SPACING frames at first, twice as often each
+// stage, PULSES pulses per stage
+#define SERVO_SOFT_START_SPACING 4
+#define SERVO_SOFT_START_PULSES 2
+
+// lead an upper beam keeps over a lower one while it retracts (20 degrees)
+#define SERVO_CLEARANCE US2POS(9*20)
+
+extern ServoActionDef Servo[NUM_OF_SERVO];
+extern uint32_t ServoSpeedScale;
+extern uint32_t ServoFrameRate[NUM_OF_TIMER];
+extern uint32_t ServoCurrentBudget;
+extern uint8_t ServoTrace;
+
+#define SERVO_MASK(index) (1U << (index))
+#define SERVO_MASK_ALL ((1U << NUM_OF_SERVO) - 1)
+
+extern void ServoInit(void);
+extern void RescanPosition(void);
+extern void ServoPwmStart(int16_t index);
+extern void ServoSoftStart(void);
+extern void ServoSetFrameRate(uint32_t slot, uint32_t rate);
+extern void ServoGetProfile(int16_t index, uint32_t goal, ProfileDef *profile);
+extern void ServoStart(int16_t index, uint32_t goal);
+extern void ServoRetarget(int16_t index, uint32_t goal);
+extern void ServoStop(int16_t index);
+extern void ServoRequestAbort(uint16_t mask);
+extern uint8_t ServoAborted(void);
+extern uint8_t ServoAbortPending(void);
+extern void ServoSetNotify(int16_t index, uint32_t travel);
+extern uint8_t ServoIsMoving(int16_t index);
+extern void ServoWaitAll(uint16_t mask);
+extern uint16_t ServoWaitAny(uint16_t mask);
+extern void ServoWaitClear(int16_t index, uint32_t travel);
+extern uint8_t ServoIsSettled(int16_t index);
+extern void ServoWaitSettled(uint16_t mask);
+extern uint32_t ServoGateIdle(void);
+extern uint32_t ServoTravel(int16_t index);
+extern void MotionRun(const MotionStepDef *steps, uint16_t count);
+extern void MotionRunGroup(const MotionStepDef *steps, uint16_t count, uint32_t time);
+extern void MotionRunLinear(const MotionStepDef *steps, uint16_t count, uint32_t time);
+extern uint32_t ServoApproach(int16_t index, uint32_t goal);
+extern void moveServo(int16_t index, uint32_t goal);
+extern void ServoLand(int16_t index, uint32_t goal);
+#if SERVO_USE_UPDATE_IRQ
+extern void ServoTimerIRQHandler(TIM_HandleTypeDef *htim);
+#endif
+#if SERVO_USE_DMA_BURST
+extern void ServoDmaIRQHandler(void);
+#endif
+
+#endif /* __SERVO_H */
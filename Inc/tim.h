@@ -45,6 +45,18 @@
 extern TIM_HandleTypeDef htim2;
 extern TIM_HandleTypeDef htim3;
 
+/* 1: count the servo timers at 3 MHz, a third of a us per step, instead of
+   1 MHz. 48 MHz does not fit a 20 ms period into the 16-bit TIM3. */
+#define SERVO_FINE_PULSE 0
+
+#if SERVO_FINE_PULSE
+#define SERVO_TICKS_PER_US 3
+#else
+#define SERVO_TICKS_PER_US 1
+#endif
+#define SERVO_TIM_PRESCALER (48 / SERVO_TICKS_PER_US - 1)
+#define SERVO_TIM_PERIOD (20000 * SERVO_TICKS_PER_US - 1)
+
 void MX_TIM2_Init(void);
 void MX_TIM3_Init(void);
 
@@ -3,6 +3,7 @@
   */
 
 #include <string.h>
+#include <stddef.h>
 #include "stm32f0xx_hal.h"
 #include <string.h>
 #include "cmsis_os.h"
@@ -10,6 +11,7 @@
 #include "usart.h"
 #include "gpio.h"
 #include "i2c.h"
+#include "servo.h"
 #include "command.h"
 
 #define MSG_CRLF "\r\n"
@@ -20,14 +22,25 @@
 #define MSG_BEAM_EMPTY "No beam is put on.\r\n"
 #define MSG_ALREADY_LOCKED "Warning! Already Locked.\r\n"
 #define MSG_BEAM_TOO_MANY "Only one beam should be put on.\r\n"
+#define MSG_NOT_TEACHING "Not teaching. Start a track with TEACH <n>.\r\n"
+#define MSG_TEACHING "Still teaching. Finish the track with TEACH END.\r\n"
+#define MSG_TRACK_FULL "Track is full.\r\n"
+#define MSG_TRACK_EMPTY "No track is taught.\r\n"
 
 #define EEPROM_I2C_ADDR_w (0xA0)
 #define EEPROM_I2C_ADDR_r (0xA1)
 #define EEPROM_MEM_ADDR (0x0000)
+#define EEPROM_PAGE_SIZE (32)
 #define EEPROM_I2C_TIMEOUT_ms (200)
+/* longest internal write cycle of a page, 5 ms for the 24LC64 */
+#define EEPROM_WRITE_CYCLE_ms (10)
+/* taught tracks follow the configuration, one per 8 pages */
+#define EEPROM_TRACK_ADDR (0x0100)
+#define EEPROM_TRACK_SIZE (0x0100)
+/* state of the arms after the tracks, written to the pages in turn */
+#define EEPROM_STATE_ADDR (0x0900)
+#define EEPROM_STATE_SLOTS (16)
 
-static uint8_t debug = 0;
-static uint8_t flag_locked = 0;
 
 /* Send Data over USART are stored in this buffer       */
 static UserBufferDef UserTxBuffer[TX_BUFFER_COUNT];
@@ -48,6 +61,20 @@ static void cmdInit(CommandBufferDef *cmd);
 static void cmdNeutral(CommandBufferDef *cmd);
 static void cmdHelp(CommandBufferDef *cmd);
 static void cmdDebug(CommandBufferDef *cmd);
+static void cmdSpeed(CommandBufferDef *cmd);
+static void cmdSettle(CommandBufferDef *cmd);
+static void cmdHold(CommandBufferDef *cmd);
+static void cmdPrepare(CommandBufferDef *cmd);
+static void cmdHover(CommandBufferDef *cmd);
+static void cmdApproach(CommandBufferDef *cmd);
+static void cmdAbort(CommandBufferDef *cmd);
+static void cmdSwap(CommandBufferDef *cmd);
+static void cmdTeach(CommandBufferDef *cmd);
+static void cmdPlay(CommandBufferDef *cmd);
+static void cmdRate(CommandBufferDef *cmd);
+static void cmdCurrent(CommandBufferDef *cmd);
+static void cmdBacklash(CommandBufferDef *cmd);
+static void cmdStatus(CommandBufferDef *cmd);
 
 typedef struct  {
 	const char *const name;
@@ -58,6 +85,7 @@ static const CommandOp CmdDic[] = {
 	{"CLEAR", cmdClear},
 	{"PUTON", cmdPutOn},
 	{"TAKEOFF", cmdTakeOff},
+	{"SWAP", cmdSwap},
 	{"HELP", cmdHelp},
 	{"VERSION", cmdVersion},
 	{"NEUTRAL", cmdNeutral},
@@ -65,92 +93,200 @@ static const CommandOp CmdDic[] = {
 	{"UP", cmdUp},
 	{"DOWN", cmdDown},
 	{"SAVE", cmdSave},
+	{"SPEED", cmdSpeed},
+	{"SETTLE", cmdSettle},
+	{"HOLD", cmdHold},
+	{"PREPARE", cmdPrepare},
+	{"HOVER", cmdHover},
+	{"APPROACH", cmdApproach},
+	{"RATE", cmdRate},
+	{"CURRENT", cmdCurrent},
+	{"BACKLASH", cmdBacklash},
+	{"ABORT", cmdAbort},
+	{"STATUS", cmdStatus},
+	{"TEACH", cmdTeach},
+	{"PLAY", cmdPlay},
 	{"INIT", cmdInit},
 	{"ENABLE_DEBUG", cmdDebug},
 	{NULL, NULL}
 };
 
-typedef struct {
-	char *name;
-	TIM_HandleTypeDef  *htim_base;
-	uint32_t channel;
-	uint32_t PutPosition;
-	uint32_t TakePosition;
-	__IO uint32_t position;
-	__IO uint32_t start;
-	__IO uint32_t goal;
-} ServoActionDef;
-
-#define SERVO_PERIOD_MS 20
-#define DEG2PULSE(deg)  (1499+9*(deg))
-
-#define SERVO_NEUTRAL_POS DEG2PULSE(0)
-
-#define CARD_PUT_POS DEG2PULSE(45)
-#define CARD_TAKE_POS DEG2PULSE(-50)
-#define RW_PUT_POS DEG2PULSE(50)
-#define RW_TAKE_POS DEG2PULSE(-45)
-
-#define SERVO_POSITION_MIN 900
-#define SERVO_POSITION_MAX 2100
 #define SERVO_ADJUST_STEP 1
+#define SERVO_ADJUST_STEP_MAX US2POS(50)
 
-static ServoActionDef Servo[] = {
-	{"R", &htim2, TIM_CHANNEL_4, RW_PUT_POS, RW_TAKE_POS, RW_TAKE_POS, RW_TAKE_POS, RW_TAKE_POS},
-	{"A", &htim3, TIM_CHANNEL_1, CARD_PUT_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS},
-	{"B", &htim3, TIM_CHANNEL_2, CARD_PUT_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS},
-	{"C", &htim3, TIM_CHANNEL_3, CARD_PUT_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS},
-	{"D", &htim3, TIM_CHANNEL_4, CARD_PUT_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS}
-};
 static const int16_t READER_INDEX = 0;
-#define NUM_OF_SERVO 5
 
-static int16_t BeamStack[NUM_OF_SERVO];
-static int16_t BeamPtr;
+/* Beams put on the target, a bit per arm and their order from the bottom.
+   Changed under a critical section, so any thread may copy it whole. */
+typedef struct {
+	uint16_t mask;					// SERVO_MASK() of each beam put on
+	uint8_t count;
+	uint8_t locked;					// arms held down by LOCK
+	int8_t order[NUM_OF_SERVO];
+} BeamStateDef;
+
+static BeamStateDef Beam;
+
+/* Arm waiting at its hover position above the stack, or -1 */
+static int16_t HoverIndex = -1;
+/* Let the motor thread prepare the arm of a queued PUTON */
+static uint8_t flag_auto_prepare = 0;
 
 typedef __packed struct {
 	char magic[2];
 	uint8_t major;
 	uint8_t minor;
 	uint32_t PutPosition[NUM_OF_SERVO];
+	uint16_t MaxVelocity[NUM_OF_SERVO];
+	uint16_t Acceleration[NUM_OF_SERVO];
+	uint8_t SpeedScale;
+	uint16_t SettleLag[NUM_OF_SERVO];
+	uint8_t TicksPerUs;				// unit of positions and speeds
+	uint16_t HoldTime[NUM_OF_SERVO];
+	uint16_t HoverOffset[NUM_OF_SERVO];
+	uint16_t ApproachZone[NUM_OF_SERVO];
+	uint16_t ApproachVelocity[NUM_OF_SERVO];
+	uint16_t FrameRate[NUM_OF_TIMER];
+	uint16_t Current[NUM_OF_SERVO];
+	uint16_t CurrentBudget;
+	int16_t Backlash[NUM_OF_SERVO];
 } __attribute__((packed)) CfgDef;
 
 static const CfgDef CfgDefault = {
  .magic = {'S', 'L'},
  .major = 0x00,
- .minor = 0x00,
+ .minor = 0x09,
  .PutPosition = {
    RW_PUT_POS,
    CARD_PUT_POS,
    CARD_PUT_POS,
    CARD_PUT_POS,
    CARD_PUT_POS,
- }
+ },
+ .MaxVelocity = {
+   SERVO_MAX_VELOCITY,
+   SERVO_MAX_VELOCITY,
+   SERVO_MAX_VELOCITY,
+   SERVO_MAX_VELOCITY,
+   SERVO_MAX_VELOCITY,
+ },
+ .Acceleration = {
+   SERVO_ACCELERATION,
+   SERVO_ACCELERATION,
+   SERVO_ACCELERATION,
+   SERVO_ACCELERATION,
+   SERVO_ACCELERATION,
+ },
+ .SpeedScale = 100,
+ .SettleLag = {
+   SERVO_SETTLE_LAG,
+   SERVO_SETTLE_LAG,
+   SERVO_SETTLE_LAG,
+   SERVO_SETTLE_LAG,
+   SERVO_SETTLE_LAG,
+ },
+ .TicksPerUs = SERVO_TICKS_PER_US,
+ .HoldTime = {
+   SERVO_HOLD_TIME,
+   SERVO_HOLD_TIME,
+   SERVO_HOLD_TIME,
+   SERVO_HOLD_TIME,
+   SERVO_HOLD_TIME,
+ },
+ .HoverOffset = {
+   SERVO_HOVER_OFFSET,
+   SERVO_HOVER_OFFSET,
+   SERVO_HOVER_OFFSET,
+   SERVO_HOVER_OFFSET,
+   SERVO_HOVER_OFFSET,
+ },
+ .ApproachZone = {
+   SERVO_APPROACH_ZONE,
+   SERVO_APPROACH_ZONE,
+   SERVO_APPROACH_ZONE,
+   SERVO_APPROACH_ZONE,
+   SERVO_APPROACH_ZONE,
+ },
+ .ApproachVelocity = {
+   SERVO_APPROACH_VELOCITY,
+   SERVO_APPROACH_VELOCITY,
+   SERVO_APPROACH_VELOCITY,
+   SERVO_APPROACH_VELOCITY,
+   SERVO_APPROACH_VELOCITY,
+ },
+ .FrameRate = {
+   SERVO_FRAME_RATE,
+   SERVO_FRAME_RATE,
+ },
+ .Current = {
+   SERVO_CURRENT,
+   SERVO_CURRENT,
+   SERVO_CURRENT,
+   SERVO_CURRENT,
+   SERVO_CURRENT,
+ },
+ .CurrentBudget = SERVO_CURRENT_BUDGET,
+ .Backlash = {
+   SERVO_BACKLASH,
+   SERVO_BACKLASH,
+   SERVO_BACKLASH,
+   SERVO_BACKLASH,
+   SERVO_BACKLASH,
+ },
  };
 static CfgDef CfgBuffer;
 
-static uint32_t ActiveChannel2Channel(HAL_TIM_ActiveChannel ac)
-{
-	uint32_t channel = TIM_CHANNEL_ALL;
-	switch (ac)
-	{
-		case HAL_TIM_ACTIVE_CHANNEL_1:
-			channel = TIM_CHANNEL_1;
-			break;
-		case HAL_TIM_ACTIVE_CHANNEL_2:
-			channel = TIM_CHANNEL_2;
-			break;
-		case HAL_TIM_ACTIVE_CHANNEL_3:
-			channel = TIM_CHANNEL_3;
-			break;
-		case HAL_TIM_ACTIVE_CHANNEL_4:
-			channel = TIM_CHANNEL_4;
-			break;
-		default:
-			break;
-	}
-	return channel;
-}
+// bytes of CfgDef saved by each older minor version; later fields take defaults
+static const uint16_t CfgMinorSize[] = {
+ offsetof(CfgDef, MaxVelocity),		// 0x00
+ offsetof(CfgDef, SettleLag),		// 0x01
+ offsetof(CfgDef, TicksPerUs),		// 0x02
+ offsetof(CfgDef, HoldTime),		// 0x03
+ offsetof(CfgDef, HoverOffset),		// 0x04
+ offsetof(CfgDef, ApproachZone),	// 0x05
+ offsetof(CfgDef, FrameRate),		// 0x06
+ offsetof(CfgDef, Current),			// 0x07
+ offsetof(CfgDef, Backlash),		// 0x08
+};
+
+#define TRACK_COUNT 8
+#define TRACK_MAX_KEYS 16
+#define TRACK_TIME_MAX 60000
+
+/* Goals of all arms, reached some time after the previous key frame */
+typedef __packed struct {
+	uint16_t time;					// ms from the previous key frame
+	uint16_t goal[NUM_OF_SERVO];
+} __attribute__((packed)) KeyFrameDef;
+
+typedef __packed struct {
+	char magic[2];
+	uint8_t TicksPerUs;				// unit of the goals
+	uint8_t count;
+	KeyFrameDef key[TRACK_MAX_KEYS];
+} __attribute__((packed)) TrackDef;
+
+/* Track being taught or played */
+static TrackDef TrackBuffer;
+/* Number of the track being taught, or -1 */
+static int16_t TeachIndex = -1;
+
+/* Goals and beams at the end of a command, restored at boot. A LOCK is
+   not kept, a reset unlocks the arms. */
+typedef __packed struct {
+	char magic[2];
+	uint16_t sequence;				// of the write, the latest slot wins
+	uint8_t TicksPerUs;				// unit of the goals
+	uint16_t goal[NUM_OF_SERVO];
+	uint16_t mask;
+	uint8_t count;
+	int8_t order[NUM_OF_SERVO];
+	int8_t hover;
+	uint8_t check;						// complement of the sum of the other bytes
+} __attribute__((packed)) StateDef;
+
+/* Last state written to the EEPROM */
+static StateDef StateSaved;
 
 /**
  * Print a string to console.
@@ -186,7 +322,7 @@ static void PutChr(char c)
 void PutUint16(uint16_t value)
 {
   static const uint8_t HexChr[] = "0123456789ABCDEF";
-	if (debug) {
+	if (ServoTrace) {
 		PutChr(':');
 		for (int s = 12; s >= 0; s -= 4) {
 			PutChr(HexChr[0x0F & (value >> s)]);
@@ -196,23 +332,17 @@ void PutUint16(uint16_t value)
 
 static uint8_t IsBeamPutOn(int16_t index)
 {
-	uint8_t result = 0;
-	for (int p = 0; p < BeamPtr; p++) 
-	{
-		if (BeamStack[p] == index) 
-		{
-			result = 1;
-			break;
-		}
-	}
-	return result;
+	return ((Beam.mask & SERVO_MASK(index)) != 0);
 }
 
 static void PushBeam(int16_t index)
 {
-	if (BeamPtr < NUM_OF_SERVO) 
+	if (Beam.count < NUM_OF_SERVO && !IsBeamPutOn(index)) 
 	{
-		BeamStack[BeamPtr++] = index;
+		__disable_irq();
+		Beam.order[Beam.count++] = index;
+		Beam.mask |= SERVO_MASK(index);
+		__enable_irq();
 	}
 	else
 	{
@@ -222,14 +352,85 @@ static void PushBeam(int16_t index)
 
 static int16_t PopBeam()
 {
-	if (BeamPtr > 0)
+	int16_t index = -1;
+	__disable_irq();
+	if (Beam.count > 0)
 	{
-		return BeamStack[--BeamPtr];
+		index = Beam.order[--Beam.count];
+		Beam.mask &= ~SERVO_MASK(index);
 	}
-	else
+	__enable_irq();
+	return index;
+}
+
+static void ClearBeams(void)
+{
+	__disable_irq();
+	Beam.mask = 0;
+	Beam.count = 0;
+	__enable_irq();
+}
+
+/**
+ * Take a consistent copy of the beam state.
+ */
+static void BeamSnapshot(BeamStateDef *copy)
+{
+	__disable_irq();
+	*copy = Beam;
+	__enable_irq();
+}
+
+/**
+ * Wait until the EEPROM has finished its last write cycle. It does not
+ * acknowledge its address meanwhile, so it is polled, letting the other
+ * threads run between the polls.
+ */
+static HAL_StatusTypeDef EepromWaitReady(void)
+{
+	uint32_t start = osKernelSysTick();
+	while (HAL_I2C_IsDeviceReady(&hi2c1, EEPROM_I2C_ADDR_w, 1, EEPROM_I2C_TIMEOUT_ms) != HAL_OK)
 	{
-		return -1;
+		if (osKernelSysTick() - start > EEPROM_WRITE_CYCLE_ms) {
+			return HAL_TIMEOUT;
+		}
+		osDelay(1);
+	}
+	return HAL_OK;
+}
+
+/**
+ * Write to the EEPROM. A write must not cross an EEPROM page, so it is
+ * split at the page boundaries. Returns without waiting for the write
+ * cycle of the last page, the next access waits for it.
+ */
+static HAL_StatusTypeDef EepromWrite(uint16_t addr, uint8_t *data, uint16_t size)
+{
+	HAL_StatusTypeDef status = HAL_OK;
+	while (size > 0 && status == HAL_OK)
+	{
+		uint16_t chunk = EEPROM_PAGE_SIZE - addr % EEPROM_PAGE_SIZE;
+		if (chunk > size) {
+			chunk = size;
+		}
+		status = EepromWaitReady();
+		if (status == HAL_OK) {
+			status = HAL_I2C_Mem_Write(&hi2c1, EEPROM_I2C_ADDR_w, addr, I2C_MEMADD_SIZE_16BIT, data, chunk, EEPROM_I2C_TIMEOUT_ms);
+		}
+		addr += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+	return status;
+}
+
+static HAL_StatusTypeDef EepromRead(uint16_t addr, uint8_t *data, uint16_t size)
+{
+	HAL_StatusTypeDef status = EepromWaitReady();
+	if (status == HAL_OK) {
+		status = HAL_I2C_Mem_Read(&hi2c1, EEPROM_I2C_ADDR_r, addr, I2C_MEMADD_SIZE_16BIT, data, size, EEPROM_I2C_TIMEOUT_ms);
 	}
+	return status;
 }
 
 static HAL_StatusTypeDef CfgSave(void)
@@ -240,13 +441,23 @@ static HAL_StatusTypeDef CfgSave(void)
 		for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
 		{
 			CfgBuffer.PutPosition[index] = Servo[index].PutPosition;
+			CfgBuffer.MaxVelocity[index] = Servo[index].MaxVelocity;
+			CfgBuffer.Acceleration[index] = Servo[index].Acceleration;
+			CfgBuffer.SettleLag[index] = Servo[index].SettleLag;
+			CfgBuffer.HoldTime[index] = Servo[index].HoldTime;
+			CfgBuffer.HoverOffset[index] = Servo[index].HoverOffset;
+			CfgBuffer.ApproachZone[index] = Servo[index].ApproachZone;
+			CfgBuffer.ApproachVelocity[index] = Servo[index].ApproachVelocity;
+			CfgBuffer.Current[index] = Servo[index].Current;
+			CfgBuffer.Backlash[index] = Servo[index].Backlash;
 		}
-		status = HAL_I2C_IsDeviceReady(&hi2c1, EEPROM_I2C_ADDR_w, 3, EEPROM_I2C_TIMEOUT_ms);
-		if (status != HAL_OK) {
-			break;
+		CfgBuffer.SpeedScale = ServoSpeedScale;
+		CfgBuffer.CurrentBudget = ServoCurrentBudget;
+		for (uint16_t slot = 0; slot < NUM_OF_TIMER; slot++)
+		{
+			CfgBuffer.FrameRate[slot] = ServoFrameRate[slot];
 		}
-		status = HAL_I2C_Mem_Write(&hi2c1, EEPROM_I2C_ADDR_w, EEPROM_MEM_ADDR, I2C_MEMADD_SIZE_16BIT, (uint8_t *)&CfgBuffer, sizeof(CfgDef), EEPROM_I2C_TIMEOUT_ms);
-		HAL_Delay(30);
+		status = EepromWrite(EEPROM_MEM_ADDR, (uint8_t *)&CfgBuffer, sizeof(CfgDef));
 	} while(0);
 	return status;
 }
@@ -256,29 +467,242 @@ static HAL_StatusTypeDef CfgLoad(void)
 {
 	HAL_StatusTypeDef status;
 	do {
-		status = HAL_I2C_IsDeviceReady(&hi2c1, EEPROM_I2C_ADDR_r, 3, EEPROM_I2C_TIMEOUT_ms);
-		if (status != HAL_OK) {
-			break;
-		}
-		status = HAL_I2C_Mem_Read(&hi2c1, EEPROM_I2C_ADDR_r, EEPROM_MEM_ADDR, I2C_MEMADD_SIZE_16BIT, (uint8_t *)&CfgBuffer, sizeof(CfgDef), EEPROM_I2C_TIMEOUT_ms);
+		status = EepromRead(EEPROM_MEM_ADDR, (uint8_t *)&CfgBuffer, sizeof(CfgDef));
 		if (status != HAL_OK) {
 			break;
 		}
+		uint16_t loaded = sizeof(CfgDef);
+		uint8_t ticks = CfgBuffer.TicksPerUs;
 		if (CfgBuffer.magic[0] != CfgDefault.magic[0] 
 			|| CfgBuffer.magic[1] != CfgDefault.magic[1]
 			|| CfgBuffer.major != CfgDefault.major
-			|| CfgBuffer.minor != CfgDefault.minor)
+			|| CfgBuffer.minor > CfgDefault.minor)
 		{
-			memcpy(&CfgBuffer, &CfgDefault, sizeof(CfgDef));
+			loaded = 0;
+		}
+		else if (CfgBuffer.minor < CfgDefault.minor)
+		{
+			// saved by an older firmware: keep its fields, default the new ones
+			loaded = CfgMinorSize[CfgBuffer.minor];
+			if (loaded <= offsetof(CfgDef, TicksPerUs)) {
+				ticks = 1;
+			}
+		}
+		if (ticks == 0) {
+			loaded = 0;
+		}
+		if (loaded == 0) {
+			ticks = SERVO_TICKS_PER_US;
+		}
+		if (ticks != SERVO_TICKS_PER_US)
+		{
+			// saved with the other timer resolution
+			for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
+			{
+				CfgBuffer.PutPosition[index] = CfgBuffer.PutPosition[index] * SERVO_TICKS_PER_US / ticks;
+				CfgBuffer.MaxVelocity[index] = CfgBuffer.MaxVelocity[index] * SERVO_TICKS_PER_US / ticks;
+				CfgBuffer.Acceleration[index] = CfgBuffer.Acceleration[index] * SERVO_TICKS_PER_US / ticks;
+				CfgBuffer.HoverOffset[index] = CfgBuffer.HoverOffset[index] * SERVO_TICKS_PER_US / ticks;
+				CfgBuffer.ApproachZone[index] = CfgBuffer.ApproachZone[index] * SERVO_TICKS_PER_US / ticks;
+				CfgBuffer.ApproachVelocity[index] = CfgBuffer.ApproachVelocity[index] * SERVO_TICKS_PER_US / ticks;
+				CfgBuffer.Backlash[index] = CfgBuffer.Backlash[index] * SERVO_TICKS_PER_US / ticks;
+			}
 		}
+		memcpy((uint8_t *)&CfgBuffer + loaded, (const uint8_t *)&CfgDefault + loaded, sizeof(CfgDef) - loaded);
 		for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
 		{
+			// a coarser resolution may round small speeds down to nothing
+			if (CfgBuffer.MaxVelocity[index] == 0) {
+				CfgBuffer.MaxVelocity[index] = 1;
+			}
+			if (CfgBuffer.Acceleration[index] == 0) {
+				CfgBuffer.Acceleration[index] = 1;
+			}
 			Servo[index].PutPosition = CfgBuffer.PutPosition[index];
+			Servo[index].MaxVelocity = CfgBuffer.MaxVelocity[index];
+			Servo[index].Acceleration = CfgBuffer.Acceleration[index];
+			Servo[index].SettleLag = CfgBuffer.SettleLag[index];
+			Servo[index].HoldTime = CfgBuffer.HoldTime[index];
+			Servo[index].HoverOffset = CfgBuffer.HoverOffset[index];
+			Servo[index].ApproachZone = CfgBuffer.ApproachZone[index];
+			Servo[index].ApproachVelocity = CfgBuffer.ApproachVelocity[index];
+			Servo[index].Current = CfgBuffer.Current[index];
+			Servo[index].Backlash = CfgBuffer.Backlash[index];
+		}
+		ServoSpeedScale = CfgBuffer.SpeedScale;
+		ServoCurrentBudget = CfgBuffer.CurrentBudget;
+		// applied by ServoInit()
+		for (uint16_t slot = 0; slot < NUM_OF_TIMER; slot++)
+		{
+			if (CfgBuffer.FrameRate[slot] >= SERVO_FRAME_RATE_MIN && CfgBuffer.FrameRate[slot] <= SERVO_FRAME_RATE_MAX) {
+				ServoFrameRate[slot] = CfgBuffer.FrameRate[slot];
+			}
 		}
 	} while(0);
 	return status;
 }
 
+static HAL_StatusTypeDef TrackSave(int16_t track)
+{
+	TrackBuffer.magic[0] = 'T';
+	TrackBuffer.magic[1] = 'K';
+	TrackBuffer.TicksPerUs = SERVO_TICKS_PER_US;
+	// the unused key frames are left as they are
+	return EepromWrite(EEPROM_TRACK_ADDR + track * EEPROM_TRACK_SIZE, (uint8_t *)&TrackBuffer,
+		sizeof(TrackBuffer) - sizeof(KeyFrameDef) * (TRACK_MAX_KEYS - TrackBuffer.count));
+}
+
+static uint8_t StateCheck(const StateDef *state)
+{
+	const uint8_t *byte = (const uint8_t *)state;
+	uint8_t sum = 0;
+	for (uint16_t n = 0; n < sizeof(StateDef) - 1; n++)
+	{
+		sum += byte[n];
+	}
+	return ~sum;
+}
+
+/**
+ * Save the goals of all arms and the beams on the target, if they changed
+ * since the last save. Each save takes the next page of the state area,
+ * which spreads the wear of the EEPROM.
+ */
+static HAL_StatusTypeDef StateSave(void)
+{
+	StateDef state;
+	BeamStateDef beam;
+	BeamSnapshot(&beam);
+	memset(&state, 0, sizeof(StateDef));
+	state.magic[0] = 'S';
+	state.magic[1] = 'B';
+	state.sequence = StateSaved.sequence;
+	state.TicksPerUs = SERVO_TICKS_PER_US;
+	for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		state.goal[index] = Servo[index].goal;
+		state.order[index] = beam.order[index];
+	}
+	state.mask = beam.mask;
+	state.count = beam.count;
+	state.hover = HoverIndex;
+	state.check = StateSaved.check;
+	if (memcmp(&state, &StateSaved, sizeof(StateDef)) == 0)
+	{
+		return HAL_OK;
+	}
+	state.sequence++;
+	state.check = StateCheck(&state);
+	StateSaved = state;
+	return EepromWrite(EEPROM_STATE_ADDR + (state.sequence % EEPROM_STATE_SLOTS) * EEPROM_PAGE_SIZE,
+		(uint8_t *)&state, sizeof(StateDef));
+}
+
+/**
+ * Restore the goals of all arms and the beams from the latest saved state,
+ * so the arms start at their last positions. Call before ServoInit().
+ */
+static HAL_StatusTypeDef StateLoad(void)
+{
+	StateDef state;
+	HAL_StatusTypeDef status = HAL_OK;
+	uint8_t found = 0;
+	for (uint16_t slot = 0; slot < EEPROM_STATE_SLOTS && status == HAL_OK; slot++)
+	{
+		status = EepromRead(EEPROM_STATE_ADDR + slot * EEPROM_PAGE_SIZE, (uint8_t *)&state, sizeof(StateDef));
+		if (status != HAL_OK
+			|| state.magic[0] != 'S'
+			|| state.magic[1] != 'B'
+			|| state.TicksPerUs == 0
+			|| state.check != StateCheck(&state))
+		{
+			continue;
+		}
+		if (!found || (int16_t)(state.sequence - StateSaved.sequence) > 0)
+		{
+			StateSaved = state;
+			found = 1;
+		}
+	}
+	if (!found)
+	{
+		return status;
+	}
+	state = StateSaved;
+	for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		// saved with the other timer resolution
+		uint32_t goal = state.goal[index] * SERVO_TICKS_PER_US / state.TicksPerUs;
+		if (goal < SERVO_POSITION_MIN) {
+			goal = SERVO_POSITION_MIN;
+		} else if (goal > SERVO_POSITION_MAX) {
+			goal = SERVO_POSITION_MAX;
+		}
+		Servo[index].position = goal;
+		Servo[index].start = goal;
+		Servo[index].goal = goal;
+	}
+	// the beams only if their order and mask agree
+	uint16_t mask = 0;
+	for (uint16_t n = 0; n < state.count && n < NUM_OF_SERVO; n++)
+	{
+		if (state.order[n] >= 0 && state.order[n] < NUM_OF_SERVO) {
+			mask |= SERVO_MASK(state.order[n]);
+		}
+	}
+	if (state.count <= NUM_OF_SERVO && mask == state.mask)
+	{
+		uint16_t bits = 0;
+		for (uint16_t m = mask; m != 0; m &= m - 1) {
+			bits++;
+		}
+		if (bits == state.count)
+		{
+			for (uint16_t n = 0; n < NUM_OF_SERVO; n++)
+			{
+				Beam.order[n] = state.order[n];
+			}
+			Beam.mask = state.mask;
+			Beam.count = state.count;
+		}
+	}
+	if (state.hover >= 0 && state.hover < NUM_OF_SERVO && !IsBeamPutOn(state.hover)) {
+		HoverIndex = state.hover;
+	}
+	return status;
+}
+
+/**
+ * Load a taught track. A track never taught comes out with no key frames.
+ */
+static HAL_StatusTypeDef TrackLoad(int16_t track)
+{
+	HAL_StatusTypeDef status = EepromRead(EEPROM_TRACK_ADDR + track * EEPROM_TRACK_SIZE, (uint8_t *)&TrackBuffer, sizeof(TrackBuffer));
+	if (status != HAL_OK
+		|| TrackBuffer.magic[0] != 'T'
+		|| TrackBuffer.magic[1] != 'K'
+		|| TrackBuffer.TicksPerUs == 0
+		|| TrackBuffer.count > TRACK_MAX_KEYS)
+	{
+		TrackBuffer.count = 0;
+	}
+	for (uint16_t k = 0; k < TrackBuffer.count; k++)
+	{
+		for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
+		{
+			// taught with the other timer resolution
+			uint32_t goal = TrackBuffer.key[k].goal[index] * SERVO_TICKS_PER_US / TrackBuffer.TicksPerUs;
+			if (goal < SERVO_POSITION_MIN) {
+				goal = SERVO_POSITION_MIN;
+			} else if (goal > SERVO_POSITION_MAX) {
+				goal = SERVO_POSITION_MAX;
+			}
+			TrackBuffer.key[k].goal[index] = goal;
+		}
+	}
+	return status;
+}
+
 /**
   * Enable/Disable debug dump of arm position.
 	*
@@ -293,10 +717,10 @@ static void cmdDebug(CommandBufferDef *cmd)
 	switch (cmd->Arg[0])
 	{
 		case '0':
-			debug = 0;
+			ServoTrace = 0;
 			break;
 		case '1':
-			debug = 1;
+			ServoTrace = 1;
 			break;
 		default:
 			PutStr(MSG_INVALID_PARAMETER);
@@ -325,17 +749,6 @@ static int16_t name2servoIndex(char c)
 	return index;
 }
 
-/**
- * Re-scan current position by reading timer register.
- */
-static void RescanPosition()
-{
-	for (int index = 0; index < NUM_OF_SERVO; index++)
-	{
-		Servo[index].position = __HAL_TIM_GetCompare(Servo[index].htim_base, Servo[index].channel);
-	}
-}
-
 /**
  * Adujst put position of selected servo.
  *
@@ -354,75 +767,111 @@ static void AdjustPutPosition(int16_t index, int16_t offset)
 }
 
 /**
-  * @param  idxSrv: Index of servo motor.
-  * @param  end: End position.
+  * Append a move to a plan. The move may start once the previous one has
+  * moved clear, so the plan keeps the stacking order of its steps.
   */
-static void moveServo(int16_t index, uint32_t goal)
+static void AddStep(MotionStepDef *plan, uint16_t *count, int16_t index, uint32_t goal)
 {
-	ServoActionDef *servo = &Servo[index];
-	// pause PWM
-	HAL_TIM_PWM_Stop_IT(servo->htim_base, servo->channel);
-	servo->start = servo->position;
-	servo->goal = goal;
-	PutUint16(Servo[index].position);
-	// restart PWM
-	HAL_TIM_PWM_Start_IT(servo->htim_base, servo->channel);
+	MotionStepDef *step = &plan[*count];
+	step->index = index;
+	step->goal = goal;
+	step->after = *count - 1;
+	step->clearance = SERVO_CLEARANCE;
+	(*count)++;
+}
 
-	while (servo->position != goal)
+/**
+  * Send the moves of a plan to the overshoot of their goals where backlash
+  * compensation asks for it, see ServoApproach(). The goals are kept for
+  * LandSteps().
+  */
+static void OvershootSteps(MotionStepDef *plan, uint16_t count, uint32_t *goal)
+{
+	for (uint16_t n = 0; n < count; n++)
 	{
-		PutUint16(servo->position);		// print position if debug is enabled
-		osDelay(SERVO_PERIOD_MS);
+		goal[n] = plan[n].goal;
+		plan[n].goal = ServoApproach(plan[n].index, goal[n]);
 	}
-	HAL_GPIO_WritePin(GPIOC, GPIO_PIN_8, GPIO_PIN_RESET);
 }
 
+/**
+  * Turn the overshot moves of a plan back to their goals, all at once.
+  */
+static void LandSteps(MotionStepDef *plan, uint16_t count, const uint32_t *goal)
+{
+	uint16_t turns = 0;
+	for (uint16_t n = 0; n < count; n++)
+	{
+		if (plan[n].goal != goal[n])
+		{
+			plan[turns] = plan[n];
+			plan[turns].goal = goal[n];
+			turns++;
+		}
+	}
+	if (turns > 0) {
+		MotionRunGroup(plan, turns, 0);
+	}
+}
 
 /**
   * Clear all arms.
   */
 static void cmdClear(CommandBufferDef *cmd)
 {
-	if (flag_locked)
+	if (Beam.locked)
 	{
 		PutStr(MSG_ALREADY_LOCKED);
 		return;
 	}
-	// set beam stack by order of position
+	// order all arms from the top by position, a hovering arm included.
+	// A higher card has a lower position, and RW is on top.
 	RescanPosition();
-	BeamPtr = 0;
-	int16_t *p, *q;
-	int16_t *tail = &BeamStack[NUM_OF_SERVO - 1];
-	for (uint16_t index = 1; index < NUM_OF_SERVO; index++)
-	{
-		BeamStack[BeamPtr++] = index;
-	}
-	for (p = BeamStack; p < tail; p++)
+	HoverIndex = -1;
+	int16_t order[NUM_OF_SERVO];
+	uint16_t arms = 0;
+	order[arms++] = READER_INDEX;
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
 	{
-		for (q = p + 1; q < tail; q++)
+		if (index == READER_INDEX)
 		{
-			if (Servo[*p].position < Servo[*q].position)
-			{
-				int16_t tmp = *q;
-				*q = *p;
-				*p = tmp;
-			}
+			continue;
+		}
+		uint16_t n = arms++;
+		while (n > 1 && Servo[order[n - 1]].position > Servo[index].position)
+		{
+			order[n] = order[n - 1];
+			n--;
 		}
+		order[n] = index;
 	}
-	// put RW top
-	BeamStack[BeamPtr++] = 0;
-	// unstack all
+	ClearBeams();
+	// unstack all, each beam as soon as the ones above have moved clear
 	PutStr("CLEAR ");
-	for (;;)
+	MotionStepDef plan[NUM_OF_SERVO];
+	PlanBeamDef beam[NUM_OF_SERVO];
+	uint16_t count = 0;
+	for (uint16_t n = 0; n < arms; n++)
 	{
-		int16_t index = PopBeam();
-		if (index < 0) {
-			break;
-		}
+		int16_t index = order[n];
 		PutChr(Servo[index].name[0]);
 		PutUint16(Servo[index].position);
 		PutChr(' ');
-		moveServo(index, Servo[index].TakePosition);
+		beam[count].position = Servo[index].position;
+		ServoGetProfile(index, Servo[index].TakePosition, &beam[count].profile);
+		AddStep(plan, &count, index, Servo[index].TakePosition);
+	}
+	PlanClear(beam, count, SERVO_CLEARANCE, plan);
+	if (!PlanCheck(beam, count, SERVO_CLEARANCE, plan))
+	{
+		// one beam after another
+		for (uint16_t n = 1; n < count; n++)
+		{
+			plan[n].after = n - 1;
+			plan[n].clearance = CLEARANCE_STOPPED;
+		}
 	}
+	MotionRun(plan, count);
 	PutStr("\r\n");
 }
 
@@ -431,22 +880,110 @@ static void cmdClear(CommandBufferDef *cmd)
   */
 static void cmdLock(CommandBufferDef *cmd)
 {
-	if (flag_locked)
+	if (Beam.locked)
 	{
 		PutStr(MSG_ALREADY_LOCKED);
 		return;
 	}
 	cmdClear(NULL);
 	PutStr("LOCK ");
+	MotionStepDef plan[NUM_OF_SERVO];
+	uint16_t count = 0;
 	for (uint16_t index = 1; index < NUM_OF_SERVO; index++)
 	{
 		PutChr(Servo[index].name[0]);
 		PutChr(' ');
-		moveServo(index, Servo[index].PutPosition);
+		AddStep(plan, &count, index, Servo[index].PutPosition);
 		PushBeam(index);
 	}
+	// the whole stack lands at once, from the side PUTON lands from
+	uint32_t goal[NUM_OF_SERVO];
+	OvershootSteps(plan, count, goal);
+	MotionRunGroup(plan, count, 0);
+	LandSteps(plan, count, goal);
 	PutStr("\r\n");
-	flag_locked = 1;
+	Beam.locked = 1;
+}
+
+/**
+ * Parse an unsigned decimal number and skip blanks after it.
+ *
+ * @param ptr Pointer to the first digit.
+ * @param value Parsed value.
+ * @retval Pointer to the next argument, or NULL if no number was found.
+ */
+static char *ParseUint(char *ptr, uint32_t *value)
+{
+	if (ptr == NULL || *ptr < '0' || *ptr > '9') {
+		return NULL;
+	}
+	*value = 0;
+	while (*ptr >= '0' && *ptr <= '9') {
+		*value = *value * 10 + (*ptr - '0');
+		ptr++;
+	}
+	while (*ptr == ' ' || *ptr == '\t') {
+		ptr++;
+	}
+	return ptr;
+}
+
+/**
+ * Parse an arm name and skip blanks after it.
+ *
+ * @param ptr Argument starting with the arm name.
+ * @param index Index of the arm.
+ * @retval Pointer to the next argument, or NULL if no arm was named.
+ */
+static char *ParseServo(char *ptr, int16_t *index)
+{
+	*index = name2servoIndex(ptr[0]);
+	if (*index < 0) {
+		return NULL;
+	}
+	ptr++;
+	while (*ptr == ' ' || *ptr == '\t') {
+		ptr++;
+	}
+	return ptr;
+}
+
+/**
+ * Parse an arm name followed by a number of at most max.
+ *
+ * @param ptr Argument starting with the arm name.
+ * @param index Index of the arm.
+ * @param value Parsed value.
+ * @param max Largest valid value.
+ * @retval Pointer to the next argument, or NULL if either is invalid.
+ */
+static char *ParseServoArg(char *ptr, int16_t *index, uint32_t *value, uint32_t max)
+{
+	ptr = ParseServo(ptr, index);
+	ptr = ParseUint(ptr, value);
+	if (ptr == NULL || *value > max) {
+		return NULL;
+	}
+	return ptr;
+}
+
+/**
+ * Get the adjustment of UP and DOWN, in steps of the timer.
+ *
+ * @param cmd Command with an optional step count.
+ * @retval Steps to adjust, or 0 if the argument is invalid.
+ */
+static int16_t ParseAdjustStep(CommandBufferDef *cmd)
+{
+	uint32_t step = SERVO_ADJUST_STEP;
+	if (cmd->Arg != NULL)
+	{
+		char *ptr = ParseUint(cmd->Arg, &step);
+		if (ptr == NULL || *ptr != '\0' || step > SERVO_ADJUST_STEP_MAX) {
+			return 0;
+		}
+	}
+	return step;
 }
 
 /**
@@ -454,20 +991,25 @@ static void cmdLock(CommandBufferDef *cmd)
   */
 static void cmdUp(CommandBufferDef *cmd)
 {
-	if (BeamPtr == 0)
+	if (Beam.count == 0)
 	{
 		PutStr(MSG_BEAM_EMPTY);
 		return;
 	} 
-	else if (BeamPtr > 1) {
+	else if (Beam.count > 1) {
 		PutStr(MSG_BEAM_TOO_MANY);
 		return;
 	}
+	int16_t step = ParseAdjustStep(cmd);
+	if (step == 0) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
 	PutStr("UP ");
 	// adjust up
-	int16_t index = BeamStack[0];
-	AdjustPutPosition(index, -SERVO_ADJUST_STEP);
-	moveServo(index, Servo[index].PutPosition);
+	int16_t index = Beam.order[0];
+	AdjustPutPosition(index, -step);
+	ServoLand(index, Servo[index].PutPosition);
 	PutStr("\r\n");
 }
 
@@ -476,48 +1018,281 @@ static void cmdUp(CommandBufferDef *cmd)
   */
 static void cmdDown(CommandBufferDef *cmd)
 {
-	if (BeamPtr == 0)
+	if (Beam.count == 0)
 	{
 		PutStr(MSG_BEAM_EMPTY);
 		return;
 	} 
-	else if (BeamPtr > 1) {
+	else if (Beam.count > 1) {
 		PutStr(MSG_BEAM_TOO_MANY);
 		return;
 	}
+	int16_t step = ParseAdjustStep(cmd);
+	if (step == 0) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
 	PutStr("DOWN ");
 	// adjust down
-	int16_t index = BeamStack[0];
-	AdjustPutPosition(index, +SERVO_ADJUST_STEP);
-	moveServo(index, Servo[index].PutPosition);
+	int16_t index = Beam.order[0];
+	AdjustPutPosition(index, +step);
+	ServoLand(index, Servo[index].PutPosition);
 	PutStr("\r\n");
 }
 
 /**
-  * Save all adjusted positions to the EEPROM.
+  * Set speed limits of an arm, or scale the speed of all arms.
 	*
-	* SAVE
+	* SPEED <A/B/C/D/R> <velocity> <acceleration>
+	* SPEED <percent>
   */
-static void cmdSave(CommandBufferDef *cmd)
+static void cmdSpeed(CommandBufferDef *cmd)
 {
-	PutStr("SAVE ");
-	CfgSave();
-	PutStr("\r\n");
+	uint32_t velocity, acceleration, scale;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	char *ptr = ParseUint(cmd->Arg, &scale);
+	if (ptr != NULL)
+	{
+		if (*ptr != '\0' || scale == 0 || scale > SERVO_SPEED_SCALE_MAX) {
+			PutStr(MSG_INVALID_PARAMETER);
+			return;
+		}
+		ServoSpeedScale = scale;
+		return;
+	}
+	int16_t index;
+	if ((ptr = ParseServoArg(cmd->Arg, &index, &velocity, SERVO_VELOCITY_LIMIT)) == NULL
+		|| (ptr = ParseUint(ptr, &acceleration)) == NULL
+		|| *ptr != '\0'
+		|| velocity == 0
+		|| acceleration == 0 || acceleration > SERVO_VELOCITY_LIMIT) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	Servo[index].MaxVelocity = velocity;
+	Servo[index].Acceleration = acceleration;
 }
 
 /**
-  * Reset all adjusted positions to default value.
+  * Set the time an arm lags behind its pulse width. OK is answered once
+  * all arms are expected to have settled.
 	*
-	* INIT
+	* SETTLE <A/B/C/D/R> <lag>
   */
-static void cmdInit(CommandBufferDef *cmd)
+static void cmdSettle(CommandBufferDef *cmd)
 {
-	PutStr("INIT ");
-	for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
-	{
-		Servo[index].PutPosition = CfgDefault.PutPosition[index];
+	uint32_t lag;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
 	}
-	PutStr("\r\n");
+	int16_t index;
+	char *ptr = ParseServoArg(cmd->Arg, &index, &lag, SERVO_SETTLE_LAG_MAX);
+	if (ptr == NULL || *ptr != '\0') {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	Servo[index].SettleLag = lag;
+}
+
+/**
+  * Set how long an idle arm is held before its pulses stop. The pulses
+  * resume at the held position with the next move of the arm.
+	*
+	* HOLD <A/B/C/D/R> <ms>
+  */
+static void cmdHold(CommandBufferDef *cmd)
+{
+	uint32_t hold;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	int16_t index;
+	char *ptr = ParseServoArg(cmd->Arg, &index, &hold, SERVO_HOLD_TIME_MAX);
+	if (ptr == NULL || *ptr != '\0') {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	Servo[index].HoldTime = hold;
+}
+
+/**
+  * Set the approach zone of an arm. A move landing at the put position
+  * slows down to the approach velocity before it enters the zone, the rest
+  * of the move runs at the speed limits of SPEED.
+	*
+	* APPROACH <A/B/C/D/R> <zone> <velocity>
+  */
+static void cmdApproach(CommandBufferDef *cmd)
+{
+	uint32_t zone, velocity;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	int16_t index;
+	char *ptr = ParseServoArg(cmd->Arg, &index, &zone, SERVO_POSITION_MAX - SERVO_POSITION_MIN);
+	if ((ptr = ParseUint(ptr, &velocity)) == NULL
+		|| *ptr != '\0'
+		|| velocity == 0 || velocity > SERVO_VELOCITY_LIMIT) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	Servo[index].ApproachZone = zone;
+	Servo[index].ApproachVelocity = velocity;
+}
+
+/**
+  * Set the PWM frame rate of an arm in Hz. The arms of a timer share it,
+  * A to D are on one timer. Speeds are given per frame at 50 Hz and
+  * scaled to the rate, so a faster rate moves the arms just as fast in
+  * smaller steps. Digital servos accept up to 333 Hz.
+	*
+	* RATE <A/B/C/D/R> <Hz>
+  */
+static void cmdRate(CommandBufferDef *cmd)
+{
+	uint32_t rate;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	int16_t index;
+	char *ptr = ParseServoArg(cmd->Arg, &index, &rate, SERVO_FRAME_RATE_MAX);
+	if (ptr == NULL || *ptr != '\0' || rate < SERVO_FRAME_RATE_MIN) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	// the period may only change while the timer's arms are at rest
+	ServoWaitAll(SERVO_MASK_ALL);
+	ServoSetFrameRate(TIMER_SLOT(Servo[index].htim_base), rate);
+}
+
+/**
+  * Set the current an arm draws moving at full speed, or the supply
+  * current all moving arms may draw together. Moves of CLEAR, SWAP,
+  * NEUTRAL, LOCK and PLAY wait or slow down to stay within the budget.
+	*
+	* CURRENT <A/B/C/D/R> <mA>
+	* CURRENT <mA>
+  */
+static void cmdCurrent(CommandBufferDef *cmd)
+{
+	uint32_t current;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	char *ptr = ParseUint(cmd->Arg, &current);
+	if (ptr != NULL)
+	{
+		if (*ptr != '\0' || current > 0xFFFF) {
+			PutStr(MSG_INVALID_PARAMETER);
+			return;
+		}
+		ServoCurrentBudget = current;
+		return;
+	}
+	int16_t index;
+	if ((ptr = ParseServoArg(cmd->Arg, &index, &current, SERVO_CURRENT_MAX)) == NULL
+		|| *ptr != '\0') {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	Servo[index].Current = current;
+}
+
+/**
+  * Set the backlash compensation of an arm. Its landings on the put
+  * position then always arrive moving the way DOWN or UP adjusts,
+  * overshooting by the distance when they come from the other side. DOWN
+  * is the landing direction, so its overshoots stay clear of the target.
+  * A distance of 0 turns it off.
+	*
+	* BACKLASH <A/B/C/D/R> <UP/DOWN> <distance>
+  */
+static void cmdBacklash(CommandBufferDef *cmd)
+{
+	uint32_t distance;
+	int32_t sign;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	int16_t index;
+	char *ptr = ParseServo(cmd->Arg, &index);
+	if (ptr == NULL) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	// DOWN raises the position, UP lowers it
+	if (strncmp(ptr, "DOWN", 4) == 0) {
+		sign = 1;
+		ptr += 4;
+	} else if (strncmp(ptr, "UP", 2) == 0) {
+		sign = -1;
+		ptr += 2;
+	} else {
+		sign = 0;
+	}
+	while (*ptr == ' ' || *ptr == '\t') {
+		ptr++;
+	}
+	if (sign == 0
+		|| (ptr = ParseUint(ptr, &distance)) == NULL
+		|| *ptr != '\0'
+		|| distance > SERVO_BACKLASH_MAX) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	Servo[index].Backlash = sign * (int32_t)distance;
+}
+
+/**
+  * Save all adjusted positions and speeds to the EEPROM.
+	*
+	* SAVE
+  */
+static void cmdSave(CommandBufferDef *cmd)
+{
+	PutStr("SAVE ");
+	CfgSave();
+	PutStr("\r\n");
+}
+
+/**
+  * Reset all adjusted positions and speeds to default value.
+	*
+	* INIT
+  */
+static void cmdInit(CommandBufferDef *cmd)
+{
+	PutStr("INIT ");
+	for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		Servo[index].PutPosition = CfgDefault.PutPosition[index];
+		Servo[index].MaxVelocity = CfgDefault.MaxVelocity[index];
+		Servo[index].Acceleration = CfgDefault.Acceleration[index];
+		Servo[index].SettleLag = CfgDefault.SettleLag[index];
+		Servo[index].HoldTime = CfgDefault.HoldTime[index];
+		Servo[index].HoverOffset = CfgDefault.HoverOffset[index];
+		Servo[index].ApproachZone = CfgDefault.ApproachZone[index];
+		Servo[index].ApproachVelocity = CfgDefault.ApproachVelocity[index];
+		Servo[index].Current = CfgDefault.Current[index];
+		Servo[index].Backlash = CfgDefault.Backlash[index];
+	}
+	ServoSpeedScale = CfgDefault.SpeedScale;
+	ServoCurrentBudget = CfgDefault.CurrentBudget;
+	ServoWaitAll(SERVO_MASK_ALL);
+	for (uint16_t slot = 0; slot < NUM_OF_TIMER; slot++)
+	{
+		ServoSetFrameRate(slot, CfgDefault.FrameRate[slot]);
+	}
+	PutStr("\r\n");
 }
 
 /**
@@ -525,22 +1300,51 @@ static void cmdInit(CommandBufferDef *cmd)
   */
 static void cmdNeutral(CommandBufferDef *cmd)
 {
-	if (flag_locked)
+	if (Beam.locked)
 	{
 		PutStr(MSG_ALREADY_LOCKED);
 		return;
 	}
 	cmdClear(NULL);
 	PutStr("NEUTRAL ");
+	MotionStepDef plan[NUM_OF_SERVO];
+	uint16_t count = 0;
 	for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
 	{
 		PutChr(Servo[index].name[0]);
 		PutChr(' ');
-		moveServo(index, SERVO_NEUTRAL_POS);
+		AddStep(plan, &count, index, SERVO_NEUTRAL_POS);
 	}
+	MotionRunGroup(plan, count, 0);
 	PutStr("\r\n");
 }
 
+/**
+  * Get the put position of an arm on top of the current stack.
+  */
+static uint32_t PutOnPosition(int16_t index)
+{
+	uint32_t pos = Servo[index].PutPosition;
+	if (index != READER_INDEX)
+	{
+		pos -= US2POS(3) * Beam.count;
+	}
+	return pos;
+}
+
+/**
+  * Take a hovering arm back to its take position.
+  */
+static void CancelHover(void)
+{
+	if (HoverIndex >= 0)
+	{
+		int16_t index = HoverIndex;
+		HoverIndex = -1;
+		moveServo(index, Servo[index].TakePosition);
+	}
+}
+
 /**
   * Put a card on the RF antenna.
 	*
@@ -562,22 +1366,177 @@ static void cmdPutOn(CommandBufferDef *cmd)
 		PutStr(MSG_ALRELADY_PUT);
 		return;
 	}
-	if (index == READER_INDEX && BeamPtr > 0) {
+	if (index == READER_INDEX && Beam.count > 0) {
 		PutStr(MSG_NOT_CLEAR);
 		return;
 	}
-	uint32_t pos = Servo[index].PutPosition;
-	if (index != 0)
-	{
-		pos -= 3 * BeamPtr;
+	if (HoverIndex != index) {
+		CancelHover();
 	}
+	HoverIndex = -1;
 	PutStr("PUTON ");
 	PutStr(Servo[index].name);
 	PutStr("\r\n");
-	moveServo(index, pos);
+	ServoLand(index, PutOnPosition(index));
+	if (ServoAborted())
+	{
+		// the wrong card, bring it back
+		moveServo(index, Servo[index].TakePosition);
+		return;
+	}
 	PushBeam(index);
 }
 
+/**
+  * Move an arm to its hover position above the stack, so a following PUTON
+  * of it is a short move. Any other hovering arm is taken back first.
+  *
+  * @param index Index of the arm.
+  * @param wait 1 to wait for the end of the move.
+  */
+static void Prepare(int16_t index, uint8_t wait)
+{
+	if (HoverIndex != index) {
+		CancelHover();
+	}
+	uint32_t pos = PutOnPosition(index);
+	uint32_t take = Servo[index].TakePosition;
+	uint32_t offset = Servo[index].HoverOffset;
+	// stay between the take and the put position
+	if (pos > take) {
+		pos = (pos - take > offset ? pos - offset : take);
+	} else {
+		pos = (take - pos > offset ? pos + offset : take);
+	}
+	HoverIndex = index;
+	if (wait) {
+		moveServo(index, pos);
+	} else {
+		ServoStart(index, pos);
+	}
+}
+
+/**
+  * Move the arm of a card, or the Reader, to its hover position.
+	*
+	* PREPARE <A/B/C/D/R>
+	* PREPARE AUTO
+	* PREPARE MANUAL
+  */
+static void cmdPrepare(CommandBufferDef *cmd)
+{
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	if (strcmp(cmd->Arg, "AUTO") == 0 || strcmp(cmd->Arg, "MANUAL") == 0)
+	{
+		flag_auto_prepare = (cmd->Arg[0] == 'A');
+		return;
+	}
+	int16_t index = name2servoIndex(cmd->Arg[0]);
+	if (index < 0 || cmd->Arg[1] != '\0') {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	if (Beam.locked)
+	{
+		PutStr(MSG_ALREADY_LOCKED);
+		return;
+	}
+	if (IsBeamPutOn(index))
+	{
+		PutStr(MSG_ALRELADY_PUT);
+		return;
+	}
+	if (index == READER_INDEX && Beam.count > 0) {
+		PutStr(MSG_NOT_CLEAR);
+		return;
+	}
+	PutStr("PREPARE ");
+	PutStr(Servo[index].name);
+	PutStr("\r\n");
+	Prepare(index, 1);
+}
+
+/**
+  * Set how far short of its put position an arm hovers.
+	*
+	* HOVER <A/B/C/D/R> <offset>
+  */
+static void cmdHover(CommandBufferDef *cmd)
+{
+	uint32_t offset;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	int16_t index;
+	char *ptr = ParseServoArg(cmd->Arg, &index, &offset, SERVO_POSITION_MAX - SERVO_POSITION_MIN);
+	if (ptr == NULL || *ptr != '\0' || offset < SERVO_CLEARANCE) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	Servo[index].HoverOffset = offset;
+}
+
+/**
+  * Prepare the arm of the next queued PUTON while the stack is at rest, so
+  * it hovers by the time the command runs.
+  *
+  * @retval Index of the arm started, or -1.
+  */
+static int16_t AutoPrepare(void)
+{
+	osEvent evt = osMessagePeek(CmdBoxId, 0);
+	if (!flag_auto_prepare || Beam.locked || evt.status != osEventMessage) {
+		return -1;
+	}
+	CommandBufferDef *next = evt.value.p;
+	if (next->func != cmdPutOn || next->Arg == NULL) {
+		return -1;
+	}
+	int16_t index = name2servoIndex(next->Arg[0]);
+	if (index < 0 || index == HoverIndex || IsBeamPutOn(index)
+		|| (index == READER_INDEX && Beam.count > 0)) {
+		return -1;
+	}
+	for (int16_t s = 0; s < NUM_OF_SERVO; s++)
+	{
+		if (ServoIsMoving(s)) {
+			return -1;
+		}
+	}
+	Prepare(index, 0);
+	return index;
+}
+
+/**
+  * Look ahead in the command queue for a move which may overlap the end of
+  * the current one. Taking off the next beam, or putting on an arm other
+  * than the moving ones, only has to wait until the moving arms are clear.
+  *
+  * @param moving Set of moving servos, see SERVO_MASK().
+  * @retval 1 if the next queued command may start before the moves end.
+  */
+static uint8_t NextCommandBlends(uint16_t moving)
+{
+	osEvent evt = osMessagePeek(CmdBoxId, 0);
+	if (evt.status != osEventMessage) {
+		return 0;
+	}
+	CommandBufferDef *next = evt.value.p;
+	if (next->func == cmdTakeOff) {
+		return 1;
+	}
+	if (next->func == cmdPutOn && next->Arg != NULL)
+	{
+		int16_t target = name2servoIndex(next->Arg[0]);
+		return (target >= 0 && (SERVO_MASK(target) & moving) == 0);
+	}
+	return 0;
+}
+
 /**
   * Take a card off from the RF antenna.
 	*
@@ -589,7 +1548,7 @@ static void cmdTakeOff(CommandBufferDef *cmd)
 		PutStr(MSG_INVALID_PARAMETER);
 		return;
 	}
-	if (flag_locked)
+	if (Beam.locked)
 	{
 		PutStr(MSG_ALREADY_LOCKED);
 		return;
@@ -599,10 +1558,263 @@ static void cmdTakeOff(CommandBufferDef *cmd)
 		PutStr(MSG_BEAM_EMPTY);
 		return;
 	}
+	// a hovering arm is in the way of the top beam
+	CancelHover();
 	PutStr("TAKEOFF ");
 	PutStr(Servo[index].name);
 	PutStr("\r\n");
-	moveServo(index, Servo[index].TakePosition);
+	if (NextCommandBlends(SERVO_MASK(index)))
+	{
+		// the next move starts as soon as this arm is out of the way
+		ServoStart(index, Servo[index].TakePosition);
+		ServoWaitClear(index, SERVO_CLEARANCE);
+	}
+	else
+	{
+		moveServo(index, Servo[index].TakePosition);
+	}
+	if (ServoAborted())
+	{
+		// leave the card where it was
+		ServoLand(index, PutOnPosition(index));
+		PushBeam(index);
+	}
+}
+
+/**
+  * Stop the running command and drop the queued ones. Runs at once in the
+  * receiving thread. A PUTON brakes and takes its card back, a TAKEOFF
+  * brakes and puts its card back. Moves of several arms run to their end,
+  * a PLAY stops at the next key frame.
+	*
+	* ABORT
+  */
+static void cmdAbort(CommandBufferDef *cmd)
+{
+	while (osMessageGet(CmdBoxId, 0).status == osEventMessage)
+	{
+	}
+	ServoRequestAbort(SERVO_MASK_ALL);
+	PutStr("ABORT\r\n");
+}
+
+/**
+  * Show the beams put on the target from the bottom, and LOCKED while the
+  * arms are locked. Runs at once in the receiving thread, so it also
+  * answers while a command moves arms.
+	*
+	* STATUS
+  */
+static void cmdStatus(CommandBufferDef *cmd)
+{
+	BeamStateDef state;
+	BeamSnapshot(&state);
+	PutStr("STATUS");
+	for (uint16_t n = 0; n < state.count; n++)
+	{
+		PutChr(' ');
+		PutStr(Servo[state.order[n]].name);
+	}
+	if (state.locked) {
+		PutStr(" LOCKED");
+	}
+	PutStr("\r\n");
+}
+
+/**
+  * Replace the top card with another one. The new card starts down as soon
+  * as the top one has moved clear, like the beams of CLEAR.
+	*
+	* SWAP <A/B/C/D>
+  */
+static void cmdSwap(CommandBufferDef *cmd)
+{
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	if (Beam.locked)
+	{
+		PutStr(MSG_ALREADY_LOCKED);
+		return;
+	}
+	int16_t index = name2servoIndex(cmd->Arg[0]);
+	if (index < 0 || index == READER_INDEX) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	if (IsBeamPutOn(index))
+	{
+		PutStr(MSG_ALRELADY_PUT);
+		return;
+	}
+	if (Beam.count == 0) {
+		PutStr(MSG_BEAM_EMPTY);
+		return;
+	}
+	// a hovering arm is in the way of the top beam
+	CancelHover();
+	int16_t top = PopBeam();
+	PutStr("SWAP ");
+	PutStr(Servo[top].name);
+	PutChr(' ');
+	PutStr(Servo[index].name);
+	PutStr("\r\n");
+	MotionStepDef plan[2];
+	uint16_t count = 0;
+	AddStep(plan, &count, top, Servo[top].TakePosition);
+	AddStep(plan, &count, index, PutOnPosition(index));
+	// the new card lands from the side PUTON lands from
+	uint32_t goal;
+	OvershootSteps(&plan[1], 1, &goal);
+	MotionRun(plan, count);
+	LandSteps(&plan[1], 1, &goal);
+	PushBeam(index);
+}
+
+/**
+  * Teach a track of key frames for PLAY. TEACH <n> clears all arms and
+  * starts track n. The arms are then moved, by position or by the other
+  * commands, and each KEY records the goals of all arms to be reached ms
+  * after the previous key frame. END saves the track to the EEPROM.
+	*
+	* TEACH <n>
+	* TEACH <A/B/C/D/R> <position>
+	* TEACH KEY <ms>
+	* TEACH END
+  */
+static void cmdTeach(CommandBufferDef *cmd)
+{
+	uint32_t value;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	if (Beam.locked)
+	{
+		PutStr(MSG_ALREADY_LOCKED);
+		return;
+	}
+	char *ptr = ParseUint(cmd->Arg, &value);
+	if (ptr != NULL)
+	{
+		if (*ptr != '\0' || value >= TRACK_COUNT) {
+			PutStr(MSG_INVALID_PARAMETER);
+			return;
+		}
+		// every track starts from cleared arms, like PLAY
+		cmdClear(NULL);
+		TeachIndex = value;
+		TrackBuffer.count = 0;
+		PutStr("TEACH ");
+		PutChr('0' + value);
+		PutStr("\r\n");
+		return;
+	}
+	if (TeachIndex < 0) {
+		PutStr(MSG_NOT_TEACHING);
+		return;
+	}
+	if (strcmp(cmd->Arg, "END") == 0)
+	{
+		PutStr("TEACH END\r\n");
+		TrackSave(TeachIndex);
+		TeachIndex = -1;
+		return;
+	}
+	if (strncmp(cmd->Arg, "KEY", 3) == 0)
+	{
+		ptr = cmd->Arg + 3;
+		while (*ptr == ' ' || *ptr == '\t') {
+			ptr++;
+		}
+		if ((ptr = ParseUint(ptr, &value)) == NULL
+			|| *ptr != '\0'
+			|| value > TRACK_TIME_MAX) {
+			PutStr(MSG_INVALID_PARAMETER);
+			return;
+		}
+		if (TrackBuffer.count >= TRACK_MAX_KEYS) {
+			PutStr(MSG_TRACK_FULL);
+			return;
+		}
+		KeyFrameDef *key = &TrackBuffer.key[TrackBuffer.count++];
+		key->time = value;
+		for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
+		{
+			key->goal[index] = Servo[index].goal;
+		}
+		return;
+	}
+	int16_t index;
+	if ((ptr = ParseServoArg(cmd->Arg, &index, &value, SERVO_POSITION_MAX)) == NULL
+		|| *ptr != '\0'
+		|| value < SERVO_POSITION_MIN) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	moveServo(index, value);
+}
+
+/**
+  * Play a taught track. All arms are cleared first, then move in straight
+  * lines from key frame to key frame, each at a steady speed and without a
+  * stop at the key frames in between. The arms of a key frame arrive
+  * together on time, unless they cannot move that fast. Arms are left at
+  * the last key frame, CLEAR them before putting cards on again.
+	*
+	* PLAY <n>
+  */
+static void cmdPlay(CommandBufferDef *cmd)
+{
+	uint32_t track;
+	if (cmd->Arg == NULL) {
+		PutStr(MSG_EMPTY_ARGUMENT);
+		return;
+	}
+	if (Beam.locked)
+	{
+		PutStr(MSG_ALREADY_LOCKED);
+		return;
+	}
+	char *ptr = ParseUint(cmd->Arg, &track);
+	if (ptr == NULL || *ptr != '\0' || track >= TRACK_COUNT) {
+		PutStr(MSG_INVALID_PARAMETER);
+		return;
+	}
+	if (TeachIndex >= 0) {
+		PutStr(MSG_TEACHING);
+		return;
+	}
+	if (TrackLoad(track) != HAL_OK || TrackBuffer.count == 0) {
+		PutStr(MSG_TRACK_EMPTY);
+		return;
+	}
+	cmdClear(NULL);
+	PutStr("PLAY ");
+	PutChr('0' + track);
+	PutStr("\r\n");
+	MotionStepDef plan[NUM_OF_SERVO];
+	uint32_t due = osKernelSysTick();
+	for (uint16_t k = 0; k < TrackBuffer.count; k++)
+	{
+		const KeyFrameDef *key = &TrackBuffer.key[k];
+		for (uint16_t index = 0; index < NUM_OF_SERVO; index++)
+		{
+			plan[index].index = index;
+			plan[index].goal = key->goal[index];
+			plan[index].after = -1;
+			plan[index].clearance = 0;
+		}
+		// times are kept from the start, a late key frame catches up
+		due += key->time;
+		int32_t remain = (int32_t)(due - osKernelSysTick());
+		MotionRunLinear(plan, NUM_OF_SERVO, (remain > 0 ? remain : 0));
+		// stop at a key frame
+		if (ServoAbortPending()) {
+			break;
+		}
+	}
 }
 
 /**
@@ -614,12 +1826,32 @@ static void cmdHelp(CommandBufferDef *cmd)
 	PutStr("VERSION\r\n  Show version string.\r\n");
 	PutStr("PUTON <A|B|C|D|R>\r\n  Put a card or the Reader to the target.\r\n");
 	PutStr("TAKEOFF\r\n  Take a card or the Reader from the target.\r\n");
+	PutStr("SWAP <A|B|C|D>\r\n  Take the top card off and put another one on in one move.\r\n");
 	PutStr("CLEAR\r\n  Take all cards and the Reader from the target.\r\n");
 	PutStr("LOCK\r\n  Lock all arms except R to flat position.\r\n");
-	PutStr("UP\r\n  Adjust an arm position to upper angle.\r\n");
-	PutStr("DOWN\r\n  Adjust an arm position to lower angle.\r\n");
-	PutStr("SAVE\r\n  Save all adjusted positions to the EEPROM.\r\n");
-	PutStr("INIT\r\n  Reset all adjusted positions to default value.\r\n");
+	PutStr("UP [steps]\r\n  Adjust an arm position to upper angle.\r\n");
+	PutStr("DOWN [steps]\r\n  Adjust an arm position to lower angle.\r\n");
+	PutStr("SPEED <A|B|C|D|R> <velocity> <acceleration>\r\n  Set speed limits of an arm in timer steps per frame at 50 Hz.\r\n");
+	PutStr("SPEED <percent>\r\n  Scale the speed of all arms.\r\n");
+	PutStr("SETTLE <A|B|C|D|R> <lag>\r\n  Set the settle time of an arm in us per us moved.\r\n");
+	PutStr("HOLD <A|B|C|D|R> <ms>\r\n  Stop the pulses of an arm idle for ms, 0 to hold for ever.\r\n");
+	PutStr("PREPARE <A|B|C|D|R>\r\n  Move a card or the Reader to hover above the target.\r\n");
+	PutStr("PREPARE <AUTO|MANUAL>\r\n  Prepare the card of a queued PUTON automatically, or not.\r\n");
+	PutStr("HOVER <A|B|C|D|R> <offset>\r\n  Set how far short of the put position an arm hovers.\r\n");
+	PutStr("APPROACH <A|B|C|D|R> <zone> <velocity>\r\n  Land an arm slowly over the last zone steps, 0 for none.\r\n");
+	PutStr("RATE <A|B|C|D|R> <Hz>\r\n  Set the PWM frame rate of an arm and the others on its timer.\r\n");
+	PutStr("CURRENT <A|B|C|D|R> <mA>\r\n  Set the current an arm draws moving at full speed.\r\n");
+	PutStr("CURRENT <mA>\r\n  Set the supply current for all moving arms, 0 for no limit.\r\n");
+	PutStr("BACKLASH <A|B|C|D|R> <UP|DOWN> <distance>\r\n  Make an arm always land moving UP or DOWN, 0 for either way.\r\n");
+	PutStr("STATUS\r\n  Show the cards and the Reader on the target from the bottom.\r\n");
+	PutStr("ABORT\r\n  Stop the running PUTON or TAKEOFF, and drop queued commands.\r\n");
+	PutStr("TEACH <n>\r\n  Clear all arms and start teaching track n.\r\n");
+	PutStr("TEACH <A|B|C|D|R> <position>\r\n  Move an arm while teaching.\r\n");
+	PutStr("TEACH KEY <ms>\r\n  Record the goals of all arms, reached ms after the previous key.\r\n");
+	PutStr("TEACH END\r\n  Save the taught track to the EEPROM.\r\n");
+	PutStr("PLAY <n>\r\n  Clear all arms and play track n.\r\n");
+	PutStr("SAVE\r\n  Save all adjusted positions and speeds to the EEPROM.\r\n");
+	PutStr("INIT\r\n  Reset all adjusted positions and speeds to default value.\r\n");
 	PutStr("NEUTRAL\r\n  Move all servo motors to neutral position.\r\n");
 }
 
@@ -629,21 +1861,36 @@ void StartMotorThread(void const * argument)
 	CommandBufferDef *cmdBuf;
 	
 	CfgLoad();
-	for (int16_t s = 0; s < NUM_OF_SERVO; s++)
-	{
-		HAL_TIM_PWM_Start_IT(Servo[s].htim_base, Servo[s].channel);
-		osDelay(100);
-	}
+	// the arms start where the last command left them
+	StateLoad();
+	ServoInit();
+	ServoSoftStart();
 	cmdVersion(NULL);
 	PutStr("OK\r\n");
   /* Infinite loop */
   for(;;)
   {
-    evt = osMessageGet(CmdBoxId, osWaitForever);
+		// wake up meanwhile to stop the pulses of arms idle for their hold time
+    evt = osMessageGet(CmdBoxId, ServoGateIdle());
 		if (evt.status == osEventMessage) {
 			cmdBuf = evt.value.p;
+			// an ABORT only stops the command it was given during
+			ServoAborted();
 			cmdBuf->func(cmdBuf);
+			int16_t hover = AutoPrepare();
+			uint16_t moving = 0;
+			for (int16_t s = 0; s < NUM_OF_SERVO; s++)
+			{
+				if (ServoIsMoving(s)) {
+					moving |= SERVO_MASK(s);
+				}
+			}
+			if (!NextCommandBlends(moving)) {
+				// a blended move may still be running, and arms lag behind
+				ServoWaitSettled(SERVO_MASK_ALL & ~(hover >= 0 ? SERVO_MASK(hover) : 0));
+			}
 			PutStr("OK\r\n");
+			StateSave();
 		}
 		//check received length, read UserRxBufferFS
   }
@@ -698,7 +1945,14 @@ static void LookupCommand(CommandBufferDef *cmd)
 		{
 			if (matchCount == 1 && cmd->CmdLength <= strlen(matched->name) && strncmp(matched->name, cmd->Buffer, cmd->CmdLength) == 0) {
 				cmd->func = matched->func;
-				osMessagePut(CmdBoxId, (uint32_t)cmd, 0);
+				if (cmd->func == cmdAbort || cmd->func == cmdStatus) {
+					// must not wait behind the command it stops or looks at
+					cmd->func(cmd);
+					// answered like every other command
+					PutStr("OK\r\n");
+				} else {
+					osMessagePut(CmdBoxId, (uint32_t)cmd, 0);
+				}
 			} else {
 				PutStr("SYNTAX ERROR\r\n");
 			}
@@ -748,69 +2002,6 @@ void ParseInputChars(uint8_t ch)
 	}
 }
 
-//
-ServoActionDef *handle2servo(TIM_HandleTypeDef *htim)
-{
-	ServoActionDef *srv = NULL;
-	uint32_t channel = ActiveChannel2Channel(htim->Channel) ;
-	for (int s = 0; s < NUM_OF_SERVO; s++)
-	{
-		if (Servo[s].htim_base == htim && Servo[s].channel == channel)
-		{
-			srv = &Servo[s];
-			break;
-		}
-	}
-	return srv;
-}
-
-/**
-  * @brief  PWM Pulse finished callback in non blocking mode 
-  * @param  htim : TIM handle
-  * @retval None
-  */
-void HAL_TIM_PWM_PulseFinishedCallback(TIM_HandleTypeDef *htim)
-{
-	ServoActionDef *srv = handle2servo(htim);
-	if (srv != NULL)
-	{
-		uint32_t past = (srv->position < srv->start ? srv->start - srv->position : srv->position - srv->start);
-		uint32_t remain = (srv->position < srv->goal ? srv->goal - srv->position : srv->position - srv->goal);
-		uint32_t diff = (past < remain ? past : remain);
-		uint32_t step = 1 << 24;
-		for (;;)
-		{
-			if (step == 1)
-			{
-				break;
-			}
-			else if ((diff & step) != 0)
-			{
-				step >>= 1;
-				break;
-			}
-			step >>= 1;
-		}
-		if (step > 32) {
-			step = 32;
-		}
-		if (srv->position < srv->goal)
-		{
-			srv->position +=  step;
-		}
-		else if (srv->position > srv->goal)
-		{
-			srv->position -= step;
-		}
-		__HAL_TIM_SetCompare(htim, srv->channel, srv->position);
-		// blink LEDs
-		if (srv->goal != srv->position && srv->position % 3 == 0)
-		{
-			HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_8);
-		}
-	}
-}
-
 /**
   * @brief  EXTI line detection callbacks.
   * @param GPIO_Pin: Specifies the pins connected EXTI line
@@ -0,0 +1,292 @@
+/**
+  * COPYRIGHT(c) 2014 Y.Magara
+  */
+
+#include "planner.h"
+
+/**
+  * Integer square root.
+  */
+static uint32_t isqrt(uint32_t value)
+{
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+	while (bit > value)
+	{
+		bit >>= 2;
+	}
+	while (bit != 0)
+	{
+		if (value >= root + bit)
+		{
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+		{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+/**
+  * Compute the position of a servo one PWM frame later.
+  *
+  * The velocity follows a trapezoid: it grows with the square root of the
+  * distance from the start, limited by vmax, and shrinks the same way with
+  * the distance left to the goal. A move with an approach zone slows down
+  * to vzone by the time it enters the zone and keeps below it inside.
+  *
+  * @param  profile: Move of the servo.
+  * @param  position: Current position.
+  * @retval Next position.
+  */
+uint32_t ProfileNext(const ProfileDef *profile, uint32_t position)
+{
+	uint32_t past = (position < profile->start ? profile->start - position : position - profile->start);
+	uint32_t remain = (position < profile->goal ? profile->goal - position : position - profile->goal);
+	uint32_t diff = (past < remain ? past : remain);
+	uint32_t limit = profile->vmax;
+	if (profile->zone != 0)
+	{
+		uint32_t vzone = profile->vzone;
+		if (remain > profile->zone) {
+			vzone = isqrt(vzone * vzone + (uint32_t)(2ULL * profile->accel * (remain - profile->zone) / PROFILE_ACCEL_UNIT));
+		}
+		if (limit > vzone) {
+			limit = vzone;
+		}
+	}
+	uint32_t step = isqrt((uint32_t)(2ULL * profile->accel * diff / PROFILE_ACCEL_UNIT));
+	if (step > limit) {
+		step = limit;
+	}
+	if (step == 0) {
+		step = 1;
+	}
+	if (step > remain) {
+		step = remain;
+	}
+	if (position < profile->goal)
+	{
+		position +=  step;
+	}
+	else if (position > profile->goal)
+	{
+		position -= step;
+	}
+	return position;
+}
+
+/**
+  * Count the PWM frames a servo needs to reach its goal.
+  *
+  * @param  profile: Move of the servo.
+  * @param  position: Current position.
+  * @param  limit: Frames to count at most.
+  * @retval Number of frames, or limit if the goal is further away.
+  */
+uint32_t ProfileFrames(const ProfileDef *profile, uint32_t position, uint32_t limit)
+{
+	uint32_t frames = 0;
+	while (position != profile->goal && frames < limit)
+	{
+		position = ProfileNext(profile, position);
+		frames++;
+	}
+	return frames;
+}
+
+static uint32_t Distance(uint32_t a, uint32_t b)
+{
+	return (a < b ? b - a : a - b);
+}
+
+/**
+  * Simulate the clearing of a stack frame by frame, the way MotionRun()
+  * executes it, and check that no beam comes closer than margin to a moving
+  * beam above it. Beams which do not move are out of the stack and ignored.
+  *
+  * @param  beam: Beams from the top.
+  * @param  count: Number of beams.
+  * @param  margin: Minimum lead of an upper beam over a lower one.
+  * @param  steps: Triggers of all beams.
+  * @param  at: Start frame of the last beam instead of its trigger, or -1.
+  * @param  position: Receives the positions at frame 'at', or NULL.
+  * @param  stop: Receives the frame each beam stops at, or NULL.
+  * @retval Frames until all beams stopped, or -1 if beams came too close.
+  */
+static int32_t Simulate(const PlanBeamDef *beam, uint16_t count, uint32_t margin,
+	const MotionStepDef *steps, int32_t at, uint32_t *position, int32_t *stop)
+{
+	uint32_t pos[PLAN_MAX_BEAMS];
+	uint32_t started = 0;
+	uint32_t all = (1UL << count) - 1;
+	for (uint16_t n = 0; n < count; n++)
+	{
+		pos[n] = beam[n].position;
+	}
+	for (int32_t frame = 0; frame < PLAN_MAX_FRAMES; frame++)
+	{
+		// start beams whose trigger is satisfied
+		for (uint16_t n = 0; n < count; n++)
+		{
+			if ((started & (1UL << n)) != 0)
+			{
+				continue;
+			}
+			int16_t after = steps[n].after;
+			if (n == count - 1 && at >= 0)
+			{
+				if (frame >= at) {
+					started |= (1UL << n);
+				}
+			}
+			else if (after < 0
+				|| ((started & (1UL << after)) != 0
+					&& (pos[after] == beam[after].profile.goal
+						|| Distance(pos[after], beam[after].profile.start) >= steps[n].clearance))) {
+				started |= (1UL << n);
+			}
+		}
+		if (frame == at && position != 0)
+		{
+			for (uint16_t n = 0; n < count; n++)
+			{
+				position[n] = pos[n];
+			}
+		}
+		// check the lead of each moving upper beam over each started lower beam
+		for (uint16_t j = 1; j < count; j++)
+		{
+			if ((started & (1UL << j)) == 0 || beam[j].profile.start == beam[j].profile.goal)
+			{
+				continue;
+			}
+			for (uint16_t i = 0; i < j; i++)
+			{
+				const ProfileDef *upper = &beam[i].profile;
+				if ((started & (1UL << i)) == 0 || pos[i] == upper->goal)
+				{
+					continue;
+				}
+				int32_t lead = (upper->goal < upper->start ? (int32_t)(pos[j] - pos[i]) : (int32_t)(pos[i] - pos[j]));
+				if (lead < (int32_t)margin)
+				{
+					return -1;
+				}
+			}
+		}
+		// advance one frame
+		uint8_t moving = 0;
+		for (uint16_t n = 0; n < count; n++)
+		{
+			if ((started & (1UL << n)) != 0 && pos[n] != beam[n].profile.goal)
+			{
+				pos[n] = ProfileNext(&beam[n].profile, pos[n]);
+				moving = 1;
+				if (stop != 0 && pos[n] == beam[n].profile.goal) {
+					stop[n] = frame + 1;
+				}
+			}
+		}
+		if (!moving && started == all)
+		{
+			return frame;
+		}
+	}
+	return -1;
+}
+
+/**
+  * Plan the clearing of a stack so each beam starts retracting as soon as
+  * the beams above it have moved clear, without ever coming closer than
+  * margin to a moving beam above.
+  *
+  * Delaying a lower beam never reduces its distance to the beams above, so
+  * the earliest safe start frame is found by bisection. It is then turned
+  * into a trigger on the nearest beam above which still moves at that
+  * frame, or on the one which stopped last.
+  *
+  * @param  beam: Beams from the top, up to PLAN_MAX_BEAMS.
+  * @param  count: Number of beams.
+  * @param  margin: Minimum lead of an upper beam over a lower one.
+  * @param  steps: Plan whose 'after' and 'clearance' members are filled in.
+  */
+void PlanClear(const PlanBeamDef *beam, uint16_t count, uint32_t margin, MotionStepDef *steps)
+{
+	uint32_t position[PLAN_MAX_BEAMS];
+	int32_t stop[PLAN_MAX_BEAMS];
+	int32_t first = 0;
+	for (uint16_t j = 0; j < count; j++)
+	{
+		steps[j].after = j - 1;
+		steps[j].clearance = 0;
+		stop[j] = 0;
+		if (j == 0)
+		{
+			continue;
+		}
+		// all beams above have stopped by 'hi', so starting there is safe
+		int32_t lo = first;
+		int32_t hi = Simulate(beam, j, margin, steps, -1, 0, 0);
+		if (hi < lo)
+		{
+			hi = lo;
+		}
+		while (lo < hi)
+		{
+			int32_t mid = (lo + hi) / 2;
+			if (Simulate(beam, j + 1, margin, steps, mid, 0, 0) >= 0) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		Simulate(beam, j + 1, margin, steps, lo, position, stop);
+		first = lo;
+		// the nearest upper beam still moving at the start frame
+		int16_t trigger = -1;
+		for (int16_t i = j - 1; i >= 0; i--)
+		{
+			if (position[i] != beam[i].profile.goal && stop[i] > 0)
+			{
+				trigger = i;
+				break;
+			}
+		}
+		if (trigger >= 0)
+		{
+			steps[j].after = trigger;
+			steps[j].clearance = Distance(position[trigger], beam[trigger].profile.start);
+			continue;
+		}
+		// otherwise wait for the upper beam which stopped last, if any stopped late
+		for (int16_t i = j - 1; i >= 0; i--)
+		{
+			if (stop[i] > 0 && stop[i] <= lo && (trigger < 0 || stop[i] > stop[trigger]))
+			{
+				trigger = i;
+			}
+		}
+		if (trigger >= 0 && stop[trigger] == lo)
+		{
+			steps[j].after = trigger;
+			steps[j].clearance = CLEARANCE_STOPPED;
+		}
+	}
+}
+
+/**
+  * Check a plan for the clearing of a stack by simulation.
+  *
+  * @retval 1 if no beam comes closer than margin to a moving beam above it.
+  */
+uint8_t PlanCheck(const PlanBeamDef *beam, uint16_t count, uint32_t margin, const MotionStepDef *steps)
+{
+	return (Simulate(beam, count, margin, steps, -1, 0, 0) >= 0);
+}
+
+/*****END OF FILE****/
@@ -0,0 +1,1436 @@
+/**
+  * COPYRIGHT(c) 2014 Y.Magara
+  */
+
+#include "stm32f0xx_hal.h"
+#include "cmsis_os.h"
+#include "tim.h"
+#include "gpio.h"
+#include "servo.h"
+#include "command.h"
+
+ServoActionDef Servo[NUM_OF_SERVO] = {
+	{"R", &htim2, TIM_CHANNEL_4, RW_PUT_POS, RW_TAKE_POS, SERVO_MAX_VELOCITY, SERVO_ACCELERATION, SERVO_SETTLE_LAG, SERVO_HOLD_TIME, SERVO_HOVER_OFFSET, SERVO_APPROACH_ZONE, SERVO_APPROACH_VELOCITY, SERVO_CURRENT, SERVO_BACKLASH, RW_TAKE_POS, RW_TAKE_POS, RW_TAKE_POS},
+	{"A", &htim3, TIM_CHANNEL_1, CARD_PUT_POS, CARD_TAKE_POS, SERVO_MAX_VELOCITY, SERVO_ACCELERATION, SERVO_SETTLE_LAG, SERVO_HOLD_TIME, SERVO_HOVER_OFFSET, SERVO_APPROACH_ZONE, SERVO_APPROACH_VELOCITY, SERVO_CURRENT, SERVO_BACKLASH, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS},
+	{"B", &htim3, TIM_CHANNEL_2, CARD_PUT_POS, CARD_TAKE_POS, SERVO_MAX_VELOCITY, SERVO_ACCELERATION, SERVO_SETTLE_LAG, SERVO_HOLD_TIME, SERVO_HOVER_OFFSET, SERVO_APPROACH_ZONE, SERVO_APPROACH_VELOCITY, SERVO_CURRENT, SERVO_BACKLASH, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS},
+	{"C", &htim3, TIM_CHANNEL_3, CARD_PUT_POS, CARD_TAKE_POS, SERVO_MAX_VELOCITY, SERVO_ACCELERATION, SERVO_SETTLE_LAG, SERVO_HOLD_TIME, SERVO_HOVER_OFFSET, SERVO_APPROACH_ZONE, SERVO_APPROACH_VELOCITY, SERVO_CURRENT, SERVO_BACKLASH, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS},
+	{"D", &htim3, TIM_CHANNEL_4, CARD_PUT_POS, CARD_TAKE_POS, SERVO_MAX_VELOCITY, SERVO_ACCELERATION, SERVO_SETTLE_LAG, SERVO_HOLD_TIME, SERVO_HOVER_OFFSET, SERVO_APPROACH_ZONE, SERVO_APPROACH_VELOCITY, SERVO_CURRENT, SERVO_BACKLASH, CARD_TAKE_POS, CARD_TAKE_POS, CARD_TAKE_POS}
+};
+
+/* Percentage applied to MaxVelocity, and squared to Acceleration, of all servos. */
+uint32_t ServoSpeedScale = 100;
+
+/* Supply current in mA the moves of a plan may draw together, 0 for no limit. */
+uint32_t ServoCurrentBudget = SERVO_CURRENT_BUDGET;
+
+/* Dump the positions of single moves with PutUint16(), set by ENABLE_DEBUG. */
+uint8_t ServoTrace = 0;
+
+/* PWM frames per second of each timer, indexed by TIMER_SLOT(). */
+uint32_t ServoFrameRate[NUM_OF_TIMER] = {SERVO_FRAME_RATE, SERVO_FRAME_RATE};
+
+/* Released by the PWM callback when a servo reaches its goal or its notify travel. */
+static osSemaphoreId MotionSemId;
+
+/* Servo on each timer, indexed by HAL_TIM_ActiveChannel. Built by ServoInit(). */
+static ServoActionDef *ChannelMap[NUM_OF_TIMER][HAL_TIM_ACTIVE_CHANNEL_4 + 1];
+
+/* Servos to stop on request of another thread, served by the motor thread */
+static __IO uint16_t AbortMask;
+/* Set when a wait served an abort request */
+static uint8_t Aborted;
+
+static void ServoLaunch(int16_t index, uint32_t goal, uint32_t back, uint32_t pace, uint32_t frames);
+static void ServoWait(void);
+static void ServoWaitFor(uint32_t timeout);
+static uint8_t ServoFitsBudget(int16_t index, uint32_t goal);
+
+/**
+ * Distance of a servo from the start of its current move.
+ */
+static uint32_t ServoTravelOf(const ServoActionDef *srv)
+{
+	uint32_t position = srv->position;
+	return (position < srv->start ? srv->start - position : position - srv->start);
+}
+
+/**
+  * Compute the position of a servo one PWM frame later. A straight move
+  * goes by its frame count, a profiled one by its position.
+  *
+  * @param  position: Position in the current frame.
+  * @param  frame: Frames of the move run up to the current one.
+  */
+static uint32_t ServoNextPosition(const ServoActionDef *srv, uint32_t position, uint32_t frame)
+{
+	if (srv->frames != 0)
+	{
+		uint32_t next = (frame < srv->frames ? frame + 1 : srv->frames);
+		return srv->start + ((int32_t)srv->goal - (int32_t)srv->start) * (int32_t)next / (int32_t)srv->frames;
+	}
+	ProfileDef profile = {srv->start, srv->goal, srv->vmax, srv->accel, srv->zone, srv->vzone};
+	return ProfileNext(&profile, position);
+}
+
+#if SERVO_STAGGER_PHASE
+/* CH2 and CH4 put their pulse at the end of the frame with PWM mode 2 */
+#define SERVO_TRAILING(srv) (((srv)->channel & TIM_CHANNEL_2) != 0)
+#else
+#define SERVO_TRAILING(srv) 0
+#endif
+
+/* Compare interrupt of a servo channel, TIM_IT_CC1..4 */
+#define SERVO_CC_IT(srv) (TIM_IT_CC1 << ((srv)->channel >> 2))
+
+/**
+ * Convert between a position and the compare value of a servo channel.
+ * A trailing pulse starts at the compare value and lasts to the end of the
+ * frame, so the conversion is its own inverse.
+ */
+static uint32_t ServoCompare(const ServoActionDef *srv, uint32_t value)
+{
+	return (SERVO_TRAILING(srv) ? __HAL_TIM_GetAutoreload(srv->htim_base) + 1 - value : value);
+}
+
+/**
+ * Convert a velocity per frame at SERVO_FRAME_RATE to one per frame of a
+ * servo, so a faster frame rate moves it just as fast in smaller steps.
+ */
+static uint32_t ServoPerFrame(const ServoActionDef *srv, uint32_t velocity)
+{
+	return velocity * SERVO_FRAME_RATE / ServoFrameRate[TIMER_SLOT(srv->htim_base)];
+}
+
+/**
+ * Convert a number of PWM frames of a servo to ms.
+ */
+static uint32_t ServoFramesToMs(const ServoActionDef *srv, uint32_t frames)
+{
+	return frames * 1000 / ServoFrameRate[TIMER_SLOT(srv->htim_base)];
+}
+
+/**
+ * Change bits of the CCMR register half of a servo channel, given as for CH1.
+ */
+static void ServoModifyCcmr(ServoActionDef *servo, uint32_t clear, uint32_t set)
+{
+	TIM_TypeDef *tim = servo->htim_base->Instance;
+	__IO uint32_t *ccmr = (servo->channel < TIM_CHANNEL_3 ? &tim->CCMR1 : &tim->CCMR2);
+	// CH2 and CH4 are in the upper half of their CCMR register
+	uint32_t shift = ((servo->channel & TIM_CHANNEL_2) != 0 ? 8 : 0);
+	*ccmr = (*ccmr & ~(clear << shift)) | (set << shift);
+}
+
+/**
+ * Switch the output of a servo between its PWM mode and forced low. The
+ * compare register keeps the position in both modes.
+ */
+static void ServoSetOutputMode(ServoActionDef *servo, uint32_t mode)
+{
+	ServoModifyCcmr(servo, TIM_CCMR1_OC1M, mode);
+}
+
+static uint32_t ServoPwmMode(const ServoActionDef *servo)
+{
+	return (SERVO_TRAILING(servo) ? TIM_OCMODE_PWM2 : TIM_OCMODE_PWM1);
+}
+
+#if SERVO_USE_DMA_BURST
+/* Frames per DMA transfer. A transfer also ends on the frame where a servo
+   reaches its goal or its notify travel, to wake up the motor thread. */
+#define STREAM_MAX_FRAMES 32
+
+/* Compare values of one timer streamed by DMA bursts on each update event */
+typedef struct {
+	DMA_HandleTypeDef hdma;
+	TIM_HandleTypeDef *htim;
+	uint32_t first;			// first channel of the burst, 0 for CH1
+	uint32_t length;		// CCR registers per burst
+	uint32_t frames;		// frames of the running transfer, 0 when stopped
+	uint16_t Buffer[STREAM_MAX_FRAMES * 4];
+} ServoStreamDef;
+
+static ServoStreamDef Stream[NUM_OF_TIMER];
+/* DMA channel of the update request, TIM2_UP and TIM3_UP */
+static DMA_Channel_TypeDef *const StreamDmaChannel[NUM_OF_TIMER] = {DMA1_Channel2, DMA1_Channel3};
+
+static void StreamCplt(DMA_HandleTypeDef *hdma);
+
+/**
+ * Set up the DMA burst covering all servo channels of a timer.
+ */
+static void StreamInit(uint32_t slot, TIM_HandleTypeDef *htim)
+{
+	ServoStreamDef *stream = &Stream[slot];
+	uint32_t last = 0;
+	stream->htim = htim;
+	stream->first = 4;
+	for (uint32_t ch = 0; ch < 4; ch++)
+	{
+		if (ChannelMap[slot][1 << ch] != NULL)
+		{
+			if (stream->first > ch) {
+				stream->first = ch;
+			}
+			last = ch;
+		}
+	}
+	stream->length = last - stream->first + 1;
+
+	__DMA1_CLK_ENABLE();
+	stream->hdma.Instance = StreamDmaChannel[slot];
+	stream->hdma.Init.Direction = DMA_MEMORY_TO_PERIPH;
+	stream->hdma.Init.PeriphInc = DMA_PINC_DISABLE;
+	stream->hdma.Init.MemInc = DMA_MINC_ENABLE;
+	stream->hdma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+	stream->hdma.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+	stream->hdma.Init.Mode = DMA_NORMAL;
+	stream->hdma.Init.Priority = DMA_PRIORITY_HIGH;
+	HAL_DMA_Init(&stream->hdma);
+	stream->hdma.Parent = stream;
+	stream->hdma.XferCpltCallback = StreamCplt;
+
+	HAL_NVIC_SetPriority(DMA1_Channel2_3_IRQn, 3, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+}
+
+/**
+ * Precompute compare values of all moving servos of a timer.
+ *
+ * @retval Number of frames stored in the buffer, 0 if nothing moves.
+ */
+static uint32_t StreamFill(ServoStreamDef *stream, uint32_t slot)
+{
+	uint32_t position[4];
+	uint32_t frame[4];
+	uint32_t frames = 0;
+	uint8_t moving = 0;
+	for (uint32_t n = 0; n < stream->length; n++)
+	{
+		ServoActionDef *srv = ChannelMap[slot][1 << (stream->first + n)];
+		position[n] = __HAL_TIM_GetCompare(stream->htim, (stream->first + n) << 2);
+		if (srv != NULL)
+		{
+			position[n] = srv->position;
+			frame[n] = srv->frame;
+			moving |= (srv->position != srv->goal);
+		}
+	}
+	while (moving && frames < STREAM_MAX_FRAMES)
+	{
+		uint16_t *buffer = &stream->Buffer[frames++ * stream->length];
+		uint8_t event = 0;
+		moving = 0;
+		for (uint32_t n = 0; n < stream->length; n++)
+		{
+			ServoActionDef *srv = ChannelMap[slot][1 << (stream->first + n)];
+			if (srv != NULL && position[n] != srv->goal)
+			{
+				position[n] = ServoNextPosition(srv, position[n], frame[n]++);
+				uint32_t travel = (position[n] < srv->start ? srv->start - position[n] : position[n] - srv->start);
+				if (position[n] == srv->goal || (srv->notify != 0 && travel >= srv->notify)) {
+					event = 1;
+				}
+				moving |= (position[n] != srv->goal);
+			}
+			buffer[n] = (srv != NULL ? ServoCompare(srv, position[n]) : position[n]);
+		}
+		if (event) {
+			break;
+		}
+	}
+	return frames;
+}
+
+/**
+ * Start streaming the next frames of a timer, or stop if nothing moves.
+ */
+static void StreamRun(ServoStreamDef *stream, uint32_t slot)
+{
+	uint32_t frames = StreamFill(stream, slot);
+	stream->frames = frames;
+	if (frames == 0)
+	{
+		__HAL_TIM_DISABLE_DMA(stream->htim, TIM_DMA_UPDATE);
+		return;
+	}
+	// each update event writes CCRx..CCRy through DMAR. Written again for
+	// every transfer, so each one starts its bursts at CCRx.
+	stream->htim->Instance->DCR = (TIM_DMABase_CCR1 + stream->first) | ((stream->length - 1) << 8);
+	HAL_DMA_Start_IT(&stream->hdma, (uint32_t)stream->Buffer, (uint32_t)&stream->htim->Instance->DMAR, frames * stream->length);
+	// only the end of a transfer is of interest
+	__HAL_DMA_DISABLE_IT(&stream->hdma, DMA_IT_HT);
+	__HAL_TIM_ENABLE_DMA(stream->htim, TIM_DMA_UPDATE);
+}
+
+/**
+ * Take the positions of a timer's servos from the compare registers.
+ */
+static void StreamSync(ServoStreamDef *stream, uint32_t slot)
+{
+	// whole bursts written so far, the channel keeps its count when stopped
+	uint32_t done = 0;
+	if (stream->frames != 0) {
+		done = stream->frames - (stream->hdma.Instance->CNDTR + stream->length - 1) / stream->length;
+	}
+	stream->frames = 0;
+	for (uint32_t n = 0; n < stream->length; n++)
+	{
+		ServoActionDef *srv = ChannelMap[slot][1 << (stream->first + n)];
+		if (srv != NULL)
+		{
+			if (srv->position != srv->goal) {
+				srv->frame += done;
+			}
+			srv->position = ServoCompare(srv, __HAL_TIM_GetCompare(stream->htim, srv->channel));
+			if (srv->notify != 0 && ServoTravelOf(srv) >= srv->notify) {
+				srv->notify = 0;
+			}
+		}
+	}
+}
+
+/**
+ * Stop streaming a timer so its servos can be given new goals.
+ * The DMA interrupt stays disabled until StreamResume().
+ */
+static void StreamPause(ServoStreamDef *stream, uint32_t slot)
+{
+	HAL_NVIC_DisableIRQ(DMA1_Channel2_3_IRQn);
+	// a burst cut short would leave the timer at a middle register of its
+	// sequence, and the next transfer would write the wrong CCRs for a frame
+	__disable_irq();
+	while (stream->frames != 0 && stream->hdma.Instance->CNDTR % stream->length != 0)
+	{
+	}
+	__HAL_TIM_DISABLE_DMA(stream->htim, TIM_DMA_UPDATE);
+	__enable_irq();
+	HAL_DMA_Abort(&stream->hdma);
+	__HAL_DMA_CLEAR_FLAG(&stream->hdma, __HAL_DMA_GET_TC_FLAG_INDEX(&stream->hdma)
+		| __HAL_DMA_GET_HT_FLAG_INDEX(&stream->hdma) | __HAL_DMA_GET_TE_FLAG_INDEX(&stream->hdma));
+	StreamSync(stream, slot);
+}
+
+static void StreamResume(ServoStreamDef *stream, uint32_t slot)
+{
+	StreamRun(stream, slot);
+	HAL_NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+}
+
+/**
+ * DMA transfer complete callback: a servo has stopped or passed its notify
+ * travel, or the buffer ran out. Wake up the motor thread and go on.
+ */
+static void StreamCplt(DMA_HandleTypeDef *hdma)
+{
+	ServoStreamDef *stream = hdma->Parent;
+	uint32_t slot = TIMER_SLOT(stream->htim);
+	StreamSync(stream, slot);
+	osSemaphoreRelease(MotionSemId);
+	HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_8);
+	StreamRun(stream, slot);
+}
+
+/**
+ * DMA1 channel 2 and 3 interrupt, shared by the TIM2 and TIM3 streams.
+ */
+void ServoDmaIRQHandler(void)
+{
+	for (uint32_t slot = 0; slot < NUM_OF_TIMER; slot++)
+	{
+		if (Stream[slot].htim != NULL)
+		{
+			HAL_DMA_IRQHandler(&Stream[slot].hdma);
+		}
+	}
+}
+#endif
+
+/**
+ * Build the channel map and create the motion event semaphore.
+ * Call once before starting any PWM channel.
+ */
+void ServoInit(void)
+{
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		ServoActionDef *servo = &Servo[index];
+		// TIM_CHANNEL_1..4 are 0x0..0xC, HAL_TIM_ACTIVE_CHANNEL_1..4 are bit 0..3
+		ChannelMap[TIMER_SLOT(servo->htim_base)][1 << (servo->channel >> 2)] = servo;
+		ServoSetOutputMode(servo, ServoPwmMode(servo));
+		// new compare values take effect at the next update event, never
+		// in the middle of a pulse
+		ServoModifyCcmr(servo, 0, TIM_CCMR1_OC1PE);
+		__HAL_TIM_SetCompare(servo->htim_base, servo->channel, ServoCompare(servo, servo->position));
+	}
+	for (uint32_t slot = 0; slot < NUM_OF_TIMER; slot++)
+	{
+		ServoSetFrameRate(slot, ServoFrameRate[slot]);
+	}
+	// load the preloaded period and compare values now. The timers have
+	// not run yet, so the first frame would otherwise use the pulse of
+	// MX_TIMx_Init(), which a trailing channel turns into a long one.
+	htim2.Instance->EGR = TIM_EGR_UG;
+	htim3.Instance->EGR = TIM_EGR_UG;
+	__HAL_TIM_CLEAR_IT(&htim2, TIM_IT_UPDATE);
+	__HAL_TIM_CLEAR_IT(&htim3, TIM_IT_UPDATE);
+#if SERVO_STAGGER_PHASE
+	// run TIM2 half a frame after TIM3, the pulse of R falls between theirs
+	__disable_irq();
+	__HAL_TIM_SetCounter(&htim2, (__HAL_TIM_GetAutoreload(&htim2) + 1) / 2);
+	__HAL_TIM_SetCounter(&htim3, 0);
+	__HAL_TIM_ENABLE(&htim2);
+	__HAL_TIM_ENABLE(&htim3);
+	__enable_irq();
+#endif
+#if SERVO_USE_DMA_BURST
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		uint32_t slot = TIMER_SLOT(Servo[index].htim_base);
+		if (Stream[slot].htim == NULL)
+		{
+			StreamInit(slot, Servo[index].htim_base);
+		}
+	}
+#endif
+	osSemaphoreDef(MotionSem);
+	MotionSemId = osSemaphoreCreate(osSemaphore(MotionSem), 1);
+	// a binary semaphore is created available, so take it once
+	osSemaphoreWait(MotionSemId, 0);
+}
+
+/**
+  * Set the PWM frame rate of a timer. Velocities are given per frame, so
+  * moves speed up with the rate. The servos of the timer have to be at
+  * rest. The new period starts with the next frame.
+  *
+  * @param  slot: Timer, see TIMER_SLOT().
+  * @param  rate: Frames per second.
+  */
+void ServoSetFrameRate(uint32_t slot, uint32_t rate)
+{
+	ServoFrameRate[slot] = rate;
+	__disable_irq();
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		ServoActionDef *servo = &Servo[index];
+		TIM_HandleTypeDef *htim = servo->htim_base;
+		if (TIMER_SLOT(htim) != slot)
+		{
+			continue;
+		}
+		// the period is preloaded like the compare values, so the trailing
+		// pulses move along with it at the update event
+		htim->Instance->CR1 |= TIM_CR1_ARPE;
+		__HAL_TIM_SetAutoreload(htim, 1000000UL * SERVO_TICKS_PER_US / rate - 1);
+		__HAL_TIM_SetCompare(htim, servo->channel, ServoCompare(servo, servo->position));
+	}
+	__enable_irq();
+}
+
+/**
+ * Re-scan current position by reading timer register.
+ */
+void RescanPosition(void)
+{
+	for (int index = 0; index < NUM_OF_SERVO; index++)
+	{
+		Servo[index].position = ServoCompare(&Servo[index], __HAL_TIM_GetCompare(Servo[index].htim_base, Servo[index].channel));
+	}
+}
+
+/**
+  * Start the PWM output of a servo at its current position.
+  *
+  * @param  index: Index of servo motor.
+  */
+void ServoPwmStart(int16_t index)
+{
+#if SERVO_USE_UPDATE_IRQ || SERVO_USE_DMA_BURST
+	HAL_TIM_PWM_Start(Servo[index].htim_base, Servo[index].channel);
+#else
+	HAL_TIM_PWM_Start_IT(Servo[index].htim_base, Servo[index].channel);
+#endif
+}
+
+/**
+  * Get the move a servo would make from its current position to a goal,
+  * scaled by the global speed and slowed down to a pace.
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  * @param  pace: Velocity in per mille of the scaled speed, 1000 for full.
+  * @param  profile: Receives the move.
+  */
+static void ServoPacedProfile(int16_t index, uint32_t goal, uint32_t pace, ProfileDef *profile)
+{
+	const ServoActionDef *servo = &Servo[index];
+	uint32_t vmax = ServoPerFrame(servo, servo->MaxVelocity * ServoSpeedScale / 100 * pace / 1000);
+	// same time scale on the acceleration keeps the shape of the move
+	uint32_t accel = servo->Acceleration * PROFILE_ACCEL_UNIT * ServoSpeedScale / 100 * ServoSpeedScale / 100;
+	accel = ServoPerFrame(servo, ServoPerFrame(servo, accel * pace / 1000 * pace / 1000));
+	profile->start = servo->position;
+	profile->goal = goal;
+	profile->vmax = (vmax > 0 ? vmax : 1);
+	profile->accel = (accel > 0 ? accel : 1);
+	profile->zone = 0;
+	profile->vzone = profile->vmax;
+	// landing towards the put position: the end of the move runs slowly
+	uint32_t miss = (goal < servo->PutPosition ? servo->PutPosition - goal : goal - servo->PutPosition);
+	if (servo->ApproachZone != 0 && miss <= servo->ApproachZone
+		&& (goal > profile->start) == (servo->PutPosition > servo->TakePosition))
+	{
+		uint32_t vzone = ServoPerFrame(servo, servo->ApproachVelocity * pace / 1000);
+		profile->zone = servo->ApproachZone;
+		if (vzone < profile->vzone) {
+			profile->vzone = (vzone > 0 ? vzone : 1);
+		}
+	}
+}
+
+/**
+  * Get the move a servo would make from its current position to a goal,
+  * scaled by the global speed.
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  * @param  profile: Receives the move.
+  */
+void ServoGetProfile(int16_t index, uint32_t goal, ProfileDef *profile)
+{
+	ServoPacedProfile(index, goal, 1000, profile);
+}
+
+/**
+  * Set up the next move of a servo. The caller keeps its interrupt source
+  * quiet meanwhile.
+  */
+static void ServoSetGoal(ServoActionDef *servo, uint32_t goal, uint32_t back, uint32_t pace, uint32_t frames)
+{
+	ProfileDef profile;
+	ServoPacedProfile(servo - Servo, goal, pace, &profile);
+	// a start behind the current position keeps the velocity it implies
+	if (goal > profile.start) {
+		profile.start = (profile.start > back ? profile.start - back : 0);
+	} else {
+		profile.start += back;
+	}
+	servo->start = profile.start;
+	servo->goal = profile.goal;
+	servo->notify = 0;
+	servo->vmax = profile.vmax;
+	servo->accel = profile.accel;
+	servo->zone = profile.zone;
+	servo->vzone = profile.vzone;
+	servo->frames = frames;
+	servo->frame = 0;
+}
+
+/**
+  * Estimate when the horn of a servo will have settled after a move. The
+  * horn follows the last pulse width after a lag growing with the move.
+  *
+  * @retval Kernel tick (ms) of the end of the move plus the lag.
+  */
+static uint32_t ServoSettleTick(int16_t index, uint32_t goal, uint32_t pace, uint32_t frames)
+{
+	ProfileDef profile;
+	ServoPacedProfile(index, goal, pace, &profile);
+	uint32_t distance = (goal < profile.start ? profile.start - goal : goal - profile.start);
+	if (frames == 0) {
+		frames = ProfileFrames(&profile, profile.start, PROFILE_NO_LIMIT);
+	}
+	return osKernelSysTick() + ServoFramesToMs(&Servo[index], frames)
+		+ distance * Servo[index].SettleLag / (1000 * SERVO_TICKS_PER_US);
+}
+
+/**
+  * Wait until the current frame of a servo is past its pulse, so its
+  * output may be switched without cutting a pulse short. The timer has to
+  * be running.
+  */
+static void ServoWaitPulse(ServoActionDef *servo)
+{
+	TIM_HandleTypeDef *htim = servo->htim_base;
+	uint32_t compare = __HAL_TIM_GetCompare(htim, servo->channel);
+	while ((__HAL_TIM_GetCounter(htim) < compare) != SERVO_TRAILING(servo))
+	{
+	}
+}
+
+/**
+  * Stop the pulses of an idle servo.
+  */
+static void ServoGate(ServoActionDef *servo)
+{
+	// a cut pulse would be a short one, and jerk the horn
+	ServoWaitPulse(servo);
+	ServoSetOutputMode(servo, TIM_OCMODE_FORCED_INACTIVE);
+#if !SERVO_USE_UPDATE_IRQ && !SERVO_USE_DMA_BURST
+	// nothing to advance until the next ServoStart()
+	__HAL_TIM_DISABLE_IT(servo->htim_base, SERVO_CC_IT(servo));
+#endif
+	servo->idle = 1;
+}
+
+/**
+  * Resume the pulses of an idle servo at its last position. The output is
+  * switched back outside the pulse time of the current period, so the
+  * first pulse is a whole one.
+  */
+static void ServoUngate(ServoActionDef *servo)
+{
+	ServoWaitPulse(servo);
+	ServoSetOutputMode(servo, ServoPwmMode(servo));
+	servo->idle = 0;
+}
+
+/**
+  * Start the PWM outputs of all servos at their current positions, with
+  * sparse pulses first. A servo drives its motor only for a while after
+  * each pulse, so an arm which is off its position after power-up moves
+  * there gently. Each stage sends pulses twice as often.
+  */
+void ServoSoftStart(void)
+{
+	uint32_t frame = 0;
+	for (uint32_t slot = 0; slot < NUM_OF_TIMER; slot++)
+	{
+		uint32_t ms = (1000 + ServoFrameRate[slot] - 1) / ServoFrameRate[slot];
+		if (ms > frame) {
+			frame = ms;
+		}
+	}
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		// no pulse gets out before the first ungate
+		ServoSetOutputMode(&Servo[index], TIM_OCMODE_FORCED_INACTIVE);
+		ServoPwmStart(index);
+		ServoGate(&Servo[index]);
+	}
+	for (uint32_t spacing = SERVO_SOFT_START_SPACING; spacing > 1; spacing /= 2)
+	{
+		for (uint32_t pulse = 0; pulse < SERVO_SOFT_START_PULSES; pulse++)
+		{
+			for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+			{
+				ServoUngate(&Servo[index]);
+			}
+			osDelay(frame);
+			for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+			{
+				ServoGate(&Servo[index]);
+			}
+			osDelay(frame * (spacing - 1));
+		}
+	}
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		ServoUngate(&Servo[index]);
+		// the hold time counts from here
+		Servo[index].settle = osKernelSysTick();
+	}
+}
+
+/**
+  * Stop the pulses of each servo which has been settled for its hold time.
+  *
+  * @retval ms until the next servo is due, or osWaitForever.
+  */
+uint32_t ServoGateIdle(void)
+{
+	uint32_t timeout = osWaitForever;
+	uint32_t now = osKernelSysTick();
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		ServoActionDef *servo = &Servo[index];
+		if (servo->HoldTime == 0 || servo->idle || ServoIsMoving(index))
+		{
+			continue;
+		}
+		int32_t remain = (int32_t)(servo->settle + servo->HoldTime - now);
+		if (remain <= 0) {
+			ServoGate(servo);
+		} else if ((uint32_t)remain < timeout) {
+			timeout = remain;
+		}
+	}
+	return timeout;
+}
+
+/**
+  * Start moving a servo without waiting for the end of motion. While the
+  * move would take the moving servos over the current budget, this waits
+  * for one of them to stop first.
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  */
+void ServoStart(int16_t index, uint32_t goal)
+{
+	while (!ServoFitsBudget(index, goal))
+	{
+		ServoWait();
+	}
+	ServoLaunch(index, goal, 0, 1000, 0);
+}
+
+/**
+  * Set a new goal for a servo.
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  * @param  back: Distance of the start behind the current position, which
+  *         sets the velocity the move continues with.
+  * @param  pace: Velocity in per mille of the scaled speed, 1000 for full.
+  * @param  frames: Length of a straight move at a steady velocity, or 0
+  *         for a move which speeds up and slows down.
+  */
+static void ServoLaunch(int16_t index, uint32_t goal, uint32_t back, uint32_t pace, uint32_t frames)
+{
+	ServoActionDef *servo = &Servo[index];
+	// computed up front, the interrupt source is quiet only briefly
+	servo->settle = ServoSettleTick(index, goal, pace, frames);
+	if (servo->idle)
+	{
+		ServoUngate(servo);
+	}
+#if SERVO_USE_UPDATE_IRQ
+	TIM_HandleTypeDef *htim = servo->htim_base;
+	uint8_t ticking = ((htim->Instance->DIER & TIM_IT_UPDATE) != 0);
+	__HAL_TIM_DISABLE_IT(htim, TIM_IT_UPDATE);
+	ServoSetGoal(servo, goal, back, pace, frames);
+	if (!ticking)
+	{
+		// a stale update flag would fire in the middle of the current period
+		__HAL_TIM_CLEAR_IT(htim, TIM_IT_UPDATE);
+	}
+	if (ticking || goal != servo->position)
+	{
+		__HAL_TIM_ENABLE_IT(htim, TIM_IT_UPDATE);
+	}
+#elif SERVO_USE_DMA_BURST
+	uint32_t slot = TIMER_SLOT(servo->htim_base);
+	StreamPause(&Stream[slot], slot);
+	ServoSetGoal(servo, goal, back, pace, frames);
+	StreamResume(&Stream[slot], slot);
+#else
+	// hold off the compare interrupt of the running channel meanwhile, a
+	// compare match stays pending and is served right after
+	__HAL_TIM_DISABLE_IT(servo->htim_base, SERVO_CC_IT(servo));
+	ServoSetGoal(servo, goal, back, pace, frames);
+	__HAL_TIM_ENABLE_IT(servo->htim_base, SERVO_CC_IT(servo));
+#endif
+}
+
+/**
+  * Ask for a wake-up of the motor thread when a moving servo has travelled
+  * a distance from its start.
+  *
+  * @param  index: Index of servo motor.
+  * @param  travel: Distance from the start, 0 for no wake-up.
+  */
+void ServoSetNotify(int16_t index, uint32_t travel)
+{
+	ServoActionDef *servo = &Servo[index];
+	if (servo->notify == travel)
+	{
+		return;
+	}
+#if SERVO_USE_DMA_BURST
+	// the running transfer has to end on the new notify frame
+	uint32_t slot = TIMER_SLOT(servo->htim_base);
+	StreamPause(&Stream[slot], slot);
+	servo->notify = travel;
+	StreamResume(&Stream[slot], slot);
+#else
+	servo->notify = travel;
+#endif
+}
+
+/**
+  * @param  index: Index of servo motor.
+  * @retval 1 while the servo has not reached its goal.
+  */
+uint8_t ServoIsMoving(int16_t index)
+{
+	return (Servo[index].position != Servo[index].goal);
+}
+
+/**
+  * @param  mask: Set of servos, see SERVO_MASK().
+  * @retval Subset of mask which is not moving.
+  */
+static uint16_t StoppedMask(uint16_t mask)
+{
+	uint16_t stopped = 0;
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		if ((mask & SERVO_MASK(index)) != 0 && !ServoIsMoving(index))
+		{
+			stopped |= SERVO_MASK(index);
+		}
+	}
+	return stopped;
+}
+
+/**
+  * Stop a servo from any thread or interrupt. The motor thread brakes it
+  * smoothly from one of its waits.
+  *
+  * @param  mask: Set of servos, see SERVO_MASK().
+  */
+void ServoRequestAbort(uint16_t mask)
+{
+	__disable_irq();
+	AbortMask |= mask;
+	__enable_irq();
+	osSemaphoreRelease(MotionSemId);
+}
+
+/**
+  * Check for stops on request and drop requests not served yet.
+  *
+  * @retval 1 if a wait has stopped servos on request since the last call.
+  */
+uint8_t ServoAborted(void)
+{
+	uint8_t aborted = Aborted;
+	Aborted = 0;
+	__disable_irq();
+	AbortMask = 0;
+	__enable_irq();
+	return aborted;
+}
+
+/**
+  * @retval 1 if a stop has been requested and not served by a wait yet.
+  */
+uint8_t ServoAbortPending(void)
+{
+	return (AbortMask != 0);
+}
+
+/**
+  * Wait for the next motion event and serve abort requests.
+  */
+static void ServoWait(void)
+{
+	ServoWaitFor(osWaitForever);
+}
+
+/**
+  * Wait for the next motion event, or at most a time, and serve abort
+  * requests.
+  *
+  * @param  timeout: ms to wait at most, or osWaitForever.
+  */
+static void ServoWaitFor(uint32_t timeout)
+{
+	osSemaphoreWait(MotionSemId, timeout);
+	__disable_irq();
+	uint16_t mask = AbortMask;
+	AbortMask = 0;
+	__enable_irq();
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		if ((mask & SERVO_MASK(index)) != 0 && ServoIsMoving(index))
+		{
+			ServoStop(index);
+			Aborted = 1;
+		}
+	}
+}
+
+/**
+  * Get the velocity of a servo in the current frame and the start which
+  * gives the same velocity to a move with the given profile.
+  *
+  * @retval Distance of that start behind the current position.
+  */
+static uint32_t ServoBrakeDistance(int16_t index, const ProfileDef *profile)
+{
+	ServoActionDef *servo = &Servo[index];
+	uint32_t position = servo->position;
+	uint32_t next = ServoNextPosition(servo, position, servo->frame);
+	uint32_t velocity = (next < position ? position - next : next - position);
+	// accelerating from rest to v over d takes v * v = 2 * accel * d
+	return (velocity * velocity * PROFILE_ACCEL_UNIT + 2 * profile->accel - 1) / (2 * profile->accel);
+}
+
+/**
+  * Bring a moving servo to a stop as quickly as its acceleration allows.
+  *
+  * @param  index: Index of servo motor.
+  */
+void ServoStop(int16_t index)
+{
+	ServoActionDef *servo = &Servo[index];
+	ProfileDef profile;
+	ServoGetProfile(index, servo->goal, &profile);
+	uint32_t brake = ServoBrakeDistance(index, &profile);
+	uint32_t position = servo->position;
+	uint32_t stop = (servo->goal > position ? position + brake : position - brake);
+	if (stop < SERVO_POSITION_MIN) {
+		stop = SERVO_POSITION_MIN;
+	} else if (stop > SERVO_POSITION_MAX) {
+		stop = SERVO_POSITION_MAX;
+	}
+	ServoLaunch(index, stop, brake, 1000, 0);
+}
+
+/**
+  * Give a servo a new goal, also while it moves. A moving servo goes on
+  * from its current velocity. If the new goal is behind it, or too close
+  * to brake for, it stops first and this waits for the stop.
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  */
+void ServoRetarget(int16_t index, uint32_t goal)
+{
+	ServoActionDef *servo = &Servo[index];
+	if (!ServoIsMoving(index))
+	{
+		ServoStart(index, goal);
+		return;
+	}
+	ProfileDef profile;
+	ServoGetProfile(index, goal, &profile);
+	uint32_t brake = ServoBrakeDistance(index, &profile);
+	uint32_t position = servo->position;
+	uint8_t forward = (servo->goal > position);
+	uint32_t ahead = (forward ? (goal > position ? goal - position : 0) : (goal < position ? position - goal : 0));
+	if (ahead > 0 && ahead >= brake)
+	{
+		ServoLaunch(index, goal, brake, 1000, 0);
+		return;
+	}
+	ServoStop(index);
+	ServoWaitAll(SERVO_MASK(index));
+	ServoStart(index, goal);
+}
+
+/**
+  * Wait until all of the servos have reached their goals.
+  *
+  * @param  mask: Set of servos, see SERVO_MASK().
+  */
+void ServoWaitAll(uint16_t mask)
+{
+	while (StoppedMask(mask) != mask)
+	{
+		ServoWait();
+	}
+}
+
+/**
+  * Wait until any of the servos has reached its goal.
+  *
+  * @param  mask: Set of servos, see SERVO_MASK().
+  * @retval Subset of mask which is not moving.
+  */
+uint16_t ServoWaitAny(uint16_t mask)
+{
+	uint16_t stopped;
+	while ((stopped = StoppedMask(mask)) == 0)
+	{
+		ServoWait();
+	}
+	return stopped;
+}
+
+/**
+  * Wait until a servo has moved a distance from its start, or has stopped.
+  *
+  * @param  index: Index of servo motor.
+  * @param  travel: Distance from the start of the move.
+  */
+void ServoWaitClear(int16_t index, uint32_t travel)
+{
+	for (;;)
+	{
+		// arm the notify first, so a crossing right after the check wakes us
+		ServoSetNotify(index, travel);
+		if (!ServoIsMoving(index) || ServoTravel(index) >= travel) {
+			break;
+		}
+		ServoWait();
+	}
+}
+
+/**
+  * @param  index: Index of servo motor.
+  * @retval 1 once the servo has stopped and its horn is expected to have
+  *         caught up with the pulse width.
+  */
+uint8_t ServoIsSettled(int16_t index)
+{
+	return (!ServoIsMoving(index) && (int32_t)(osKernelSysTick() - Servo[index].settle) >= 0);
+}
+
+/**
+  * Wait until all of the servos have settled.
+  *
+  * @param  mask: Set of servos, see SERVO_MASK().
+  */
+void ServoWaitSettled(uint16_t mask)
+{
+	ServoWaitAll(mask);
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		int32_t remain = (int32_t)(Servo[index].settle - osKernelSysTick());
+		if ((mask & SERVO_MASK(index)) != 0 && remain > 0) {
+			osDelay(remain);
+		}
+	}
+}
+
+/**
+  * @param  index: Index of servo motor.
+  * @retval Distance moved since the last ServoStart().
+  */
+uint32_t ServoTravel(int16_t index)
+{
+	return ServoTravelOf(&Servo[index]);
+}
+
+/**
+  * Estimate the current a servo draws while moving at a velocity per frame
+  * of its timer. It is taken to grow in proportion to the velocity.
+  */
+static uint32_t ServoCurrentAt(const ServoActionDef *servo, uint32_t vmax)
+{
+	uint32_t rate = ServoFrameRate[TIMER_SLOT(servo->htim_base)];
+	return servo->Current * vmax * rate / (servo->MaxVelocity * SERVO_FRAME_RATE);
+}
+
+/**
+  * Estimate the current drawn by all moving servos.
+  */
+static uint32_t MovingCurrent(void)
+{
+	uint32_t load = 0;
+	for (int16_t index = 0; index < NUM_OF_SERVO; index++)
+	{
+		if (ServoIsMoving(index)) {
+			load += ServoCurrentAt(&Servo[index], Servo[index].vmax);
+		}
+	}
+	return load;
+}
+
+/**
+  * Check if a move fits the current budget next to the moving servos. A
+  * move is always admitted while nothing else moves.
+  */
+static uint8_t ServoFitsBudget(int16_t index, uint32_t goal)
+{
+	if (ServoCurrentBudget == 0)
+	{
+		return 1;
+	}
+	ProfileDef profile;
+	ServoGetProfile(index, goal, &profile);
+	uint32_t load = MovingCurrent();
+	return (load == 0 || load + ServoCurrentAt(&Servo[index], profile.vmax) <= ServoCurrentBudget);
+}
+
+/**
+  * Check if a started step of a plan has moved far enough for a step
+  * waiting on it with the given clearance.
+  */
+static uint8_t IsStepClear(const MotionStepDef *step, uint32_t clearance)
+{
+	return (!ServoIsMoving(step->index) || ServoTravel(step->index) >= clearance);
+}
+
+/**
+  * Let the PWM callback signal when each started step has moved far enough
+  * for the nearest of its waiting steps.
+  */
+static void ArmClearance(const MotionStepDef *steps, uint16_t count, uint32_t started)
+{
+	for (uint16_t n = 0; n < count; n++)
+	{
+		if ((started & (1UL << n)) == 0)
+		{
+			continue;
+		}
+		uint32_t clearance = 0;
+		for (uint16_t m = 0; m < count; m++)
+		{
+			if ((started & (1UL << m)) == 0 && steps[m].after == n
+				&& steps[m].clearance != CLEARANCE_STOPPED
+				&& (clearance == 0 || steps[m].clearance < clearance)) {
+				clearance = steps[m].clearance;
+			}
+		}
+		ServoSetNotify(steps[n].index, clearance);
+	}
+}
+
+/**
+  * Run several servo moves at once.
+  *
+  * A step is started as soon as the step named by its 'after' member has
+  * moved 'clearance' away from its start (or has finished, which is all a
+  * CLEARANCE_STOPPED step waits for), so an upper beam always leads the
+  * beam below it. Each servo may appear only once in
+  * a plan and 'after' has to refer to an earlier step.
+  *
+  * A step due to start is held back while it would take the moving servos
+  * over the current budget, and starts when one of them stops.
+  *
+  * @param  steps: Motion plan.
+  * @param  count: Number of steps, up to 32.
+  */
+void MotionRun(const MotionStepDef *steps, uint16_t count)
+{
+	uint32_t started = 0;
+	uint8_t moving;
+	for (;;)
+	{
+		moving = 0;
+		for (uint16_t n = 0; n < count; n++)
+		{
+			const MotionStepDef *step = &steps[n];
+			if ((started & (1UL << n)) == 0)
+			{
+				if ((step->after < 0
+					|| ((started & (1UL << step->after)) != 0 && IsStepClear(&steps[step->after], step->clearance)))
+					&& ServoFitsBudget(step->index, step->goal)) {
+					ServoStart(step->index, step->goal);
+					started |= (1UL << n);
+				}
+				moving = 1;
+			}
+			else if (ServoIsMoving(step->index))
+			{
+				moving = 1;
+			}
+		}
+		if (!moving) {
+			break;
+		}
+		ArmClearance(steps, count, started);
+		osSemaphoreWait(MotionSemId, osWaitForever);
+	}
+	HAL_GPIO_WritePin(GPIOC, GPIO_PIN_8, GPIO_PIN_RESET);
+}
+
+/**
+  * Find the slowest pace of each move of a group which still keeps up with
+  * a time. A slower pace never takes fewer frames, so the pace is found by
+  * bisection.
+  *
+  * @retval Estimated current of all moves together.
+  */
+static uint32_t GroupPace(const MotionStepDef *steps, uint16_t count, uint32_t time, uint32_t *pace)
+{
+	ProfileDef profile;
+	uint32_t load = 0;
+	for (uint16_t n = 0; n < count; n++)
+	{
+		// whole frames of this servo's timer within the time, rounded up
+		uint32_t rate = ServoFrameRate[TIMER_SLOT(Servo[steps[n].index].htim_base)];
+		uint32_t frames = (time * rate + 999) / 1000;
+		uint32_t lo = 1;
+		uint32_t hi = 1000;
+		while (lo < hi)
+		{
+			uint32_t mid = (lo + hi) / 2;
+			ServoPacedProfile(steps[n].index, steps[n].goal, mid, &profile);
+			if (ProfileFrames(&profile, profile.start, frames + 1) <= frames) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		pace[n] = lo;
+		ServoPacedProfile(steps[n].index, steps[n].goal, lo, &profile);
+		if (profile.start != profile.goal) {
+			load += ServoCurrentAt(&Servo[steps[n].index], profile.vmax);
+		}
+	}
+	return load;
+}
+
+/**
+  * Move several servos at once so that all of them arrive together, on the
+  * same PWM frame if their timers run at the same rate. Stop requests are
+  * left to the caller, see ServoAbortPending(). The longest move
+  * runs at full speed, or all moves are stretched to a given time. Each
+  * move is slowed down to the slowest pace which still keeps up.
+  *
+  * Moves over the current budget together are stretched further, which
+  * slows them down and lowers their current. The pace granularity may
+  * leave a short move a frame early, and a move cannot be slower than one
+  * timer step per frame.
+  *
+  * @param  steps: Moves, whose 'after' and 'clearance' members are ignored.
+  * @param  count: Number of steps, up to NUM_OF_SERVO.
+  * @param  time: Duration of the moves in ms, 0 for that of the longest one.
+  */
+void MotionRunGroup(const MotionStepDef *steps, uint16_t count, uint32_t time)
+{
+	ProfileDef profile;
+	uint16_t mask = 0;
+	for (uint16_t n = 0; n < count; n++)
+	{
+		ServoGetProfile(steps[n].index, steps[n].goal, &profile);
+		uint32_t ms = ServoFramesToMs(&Servo[steps[n].index], ProfileFrames(&profile, profile.start, PROFILE_NO_LIMIT));
+		if (ms > time) {
+			time = ms;
+		}
+	}
+	uint32_t pace[NUM_OF_SERVO];
+	uint32_t load = GroupPace(steps, count, time, pace);
+	for (uint16_t retry = 0; retry < 4 && ServoCurrentBudget != 0 && load > ServoCurrentBudget; retry++)
+	{
+		// the current goes down about as the time goes up
+		time = time * load / ServoCurrentBudget + 1;
+		load = GroupPace(steps, count, time, pace);
+	}
+	// all paces are known before the first servo starts
+	for (uint16_t n = 0; n < count; n++)
+	{
+		ServoLaunch(steps[n].index, steps[n].goal, 0, pace[n], 0);
+		mask |= SERVO_MASK(steps[n].index);
+	}
+	// like MotionRun(), run to the end whatever is requested meanwhile
+	while (StoppedMask(mask) != mask)
+	{
+		osSemaphoreWait(MotionSemId, osWaitForever);
+	}
+	HAL_GPIO_WritePin(GPIOC, GPIO_PIN_8, GPIO_PIN_RESET);
+}
+
+/**
+  * Move several servos along straight lines which end together after a
+  * time, and wait for the end. Unlike MotionRunGroup() a move does not
+  * speed up and slow down, each servo moves about the same distance in
+  * every frame. Moves given back to back thus go on from one to the next
+  * without a stop. Stop requests are left to the caller, see
+  * ServoAbortPending().
+  *
+  * The time is stretched as needed to keep each servo within its scaled
+  * MaxVelocity, and all of them within the current budget. When none of
+  * the servos moves, this just waits the time.
+  *
+  * @param  steps: Moves, whose 'after' and 'clearance' members are ignored.
+  * @param  count: Number of steps, up to NUM_OF_SERVO.
+  * @param  time: Duration of the moves in ms.
+  */
+void MotionRunLinear(const MotionStepDef *steps, uint16_t count, uint32_t time)
+{
+	uint32_t distance[NUM_OF_SERVO];
+	uint16_t mask = 0;
+	uint32_t load = 0;
+	for (uint16_t n = 0; n < count; n++)
+	{
+		const ServoActionDef *servo = &Servo[steps[n].index];
+		uint32_t position = servo->position;
+		uint32_t rate = ServoFrameRate[TIMER_SLOT(servo->htim_base)];
+		uint32_t vmax = ServoPerFrame(servo, servo->MaxVelocity * ServoSpeedScale / 100);
+		if (vmax == 0) {
+			vmax = 1;
+		}
+		distance[n] = (steps[n].goal < position ? position - steps[n].goal : steps[n].goal - position);
+		// frames at full speed, in ms rounded up
+		uint32_t ms = ((distance[n] + vmax - 1) / vmax * 1000 + rate - 1) / rate;
+		if (ms > time) {
+			time = ms;
+		}
+	}
+	for (uint16_t n = 0; n < count && ServoCurrentBudget != 0; n++)
+	{
+		const ServoActionDef *servo = &Servo[steps[n].index];
+		uint32_t frames = time * ServoFrameRate[TIMER_SLOT(servo->htim_base)] / 1000;
+		if (distance[n] != 0 && frames != 0) {
+			load += ServoCurrentAt(servo, (distance[n] + frames - 1) / frames);
+		}
+	}
+	if (ServoCurrentBudget != 0 && load > ServoCurrentBudget)
+	{
+		// the velocities, and so the current, go down as the time goes up
+		time = time * load / ServoCurrentBudget + 1;
+	}
+	for (uint16_t n = 0; n < count; n++)
+	{
+		if (distance[n] == 0) {
+			continue;
+		}
+		// the nearest whole frame, so keys given back to back keep in time
+		uint32_t frames = (time * ServoFrameRate[TIMER_SLOT(Servo[steps[n].index].htim_base)] + 500) / 1000;
+		ServoLaunch(steps[n].index, steps[n].goal, 0, 1000, (frames > 0 ? frames : 1));
+		mask |= SERVO_MASK(steps[n].index);
+	}
+	if (mask == 0)
+	{
+		osDelay(time);
+		return;
+	}
+	// like MotionRun(), run to the end whatever is requested meanwhile
+	while (StoppedMask(mask) != mask)
+	{
+		osSemaphoreWait(MotionSemId, osWaitForever);
+	}
+	HAL_GPIO_WritePin(GPIOC, GPIO_PIN_8, GPIO_PIN_RESET);
+}
+
+/**
+  * Get the position a servo with backlash compensation has to overshoot
+  * to on its way to a goal, so it arrives from the same side whatever the
+  * previous move was and the gears rest on the same flank.
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  * @retval Position to turn back from, or goal if the move arrives from
+  *         the right side already.
+  */
+uint32_t ServoApproach(int16_t index, uint32_t goal)
+{
+	uint32_t position = Servo[index].position;
+	int32_t backlash = Servo[index].Backlash;
+	if ((backlash > 0 && goal < position) || (backlash < 0 && goal > position))
+	{
+		int32_t over = (int32_t)goal - backlash;
+		if (over < SERVO_POSITION_MIN) {
+			over = SERVO_POSITION_MIN;
+		} else if (over > SERVO_POSITION_MAX) {
+			over = SERVO_POSITION_MAX;
+		}
+		return over;
+	}
+	return goal;
+}
+
+/**
+  * Move a single servo and wait for the end of motion.
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  */
+void moveServo(int16_t index, uint32_t goal)
+{
+	ServoRetarget(index, goal);
+	if (ServoTrace)
+	{
+		// print the position about once per frame
+		uint32_t frame = ServoFramesToMs(&Servo[index], 1);
+		PutUint16(Servo[index].position);
+		while (ServoIsMoving(index))
+		{
+			ServoWaitFor(frame > 0 ? frame : 1);
+			PutUint16(Servo[index].position);
+		}
+	}
+	ServoWaitAll(SERVO_MASK(index));
+	HAL_GPIO_WritePin(GPIOC, GPIO_PIN_8, GPIO_PIN_RESET);
+}
+
+/**
+  * Land a single servo on its put position and wait for the end of motion.
+  * A servo with backlash compensation coming from the other side
+  * overshoots the goal first and turns back, see ServoApproach().
+  *
+  * @param  index: Index of servo motor.
+  * @param  goal: End position.
+  */
+void ServoLand(int16_t index, uint32_t goal)
+{
+	uint32_t over = ServoApproach(index, goal);
+	if (over != goal)
+	{
+		moveServo(index, over);
+		if (Aborted) {
+			return;
+		}
+	}
+	moveServo(index, goal);
+}
+
+#if !SERVO_USE_DMA_BURST
+/**
+  * Advance a servo by one PWM frame along its trajectory.
+  * Called from interrupt context.
+  *
+  * @param  srv: Servo to advance.
+  * @retval 1 while the servo has not reached its goal.
+  */
+static uint8_t ServoAdvance(ServoActionDef *srv)
+{
+	uint8_t moving = (srv->position != srv->goal);
+	srv->position = ServoNextPosition(srv, srv->position, srv->frame++);
+	__HAL_TIM_SetCompare(srv->htim_base, srv->channel, ServoCompare(srv, srv->position));
+	// wake up the motor thread at the end of motion or at the clearance
+	if (moving && srv->position == srv->goal)
+	{
+		osSemaphoreRelease(MotionSemId);
+	}
+	else if (srv->notify != 0 && ServoTravelOf(srv) >= srv->notify)
+	{
+		srv->notify = 0;
+		osSemaphoreRelease(MotionSemId);
+	}
+	// blink LEDs
+	if (srv->goal != srv->position && srv->position % 3 == 0)
+	{
+		HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_8);
+	}
+	return (srv->goal != srv->position);
+}
+#endif
+
+#if SERVO_USE_DMA_BURST
+/* Compare registers are written by DMA, see StreamCplt(). */
+#elif SERVO_USE_UPDATE_IRQ
+/**
+  * Advance all moving servos of a timer once per period. Replaces
+  * HAL_TIM_IRQHandler() for the servo timers. The update interrupt is
+  * enabled by ServoStart() and disabled here as soon as all servos on the
+  * timer have stopped, so an idle timer raises no interrupt at all.
+  *
+  * @param  htim : TIM handle
+  */
+void ServoTimerIRQHandler(TIM_HandleTypeDef *htim)
+{
+	uint32_t slot = TIMER_SLOT(htim);
+	uint8_t moving = 0;
+	if (__HAL_TIM_GET_FLAG(htim, TIM_FLAG_UPDATE) == RESET || slot >= NUM_OF_TIMER)
+	{
+		return;
+	}
+	__HAL_TIM_CLEAR_IT(htim, TIM_IT_UPDATE);
+	for (uint32_t ac = HAL_TIM_ACTIVE_CHANNEL_1; ac <= HAL_TIM_ACTIVE_CHANNEL_4; ac <<= 1)
+	{
+		ServoActionDef *srv = ChannelMap[slot][ac];
+		if (srv != NULL && srv->position != srv->goal)
+		{
+			moving |= ServoAdvance(srv);
+		}
+	}
+	if (!moving)
+	{
+		__HAL_TIM_DISABLE_IT(htim, TIM_IT_UPDATE);
+	}
+}
+#else
+/**
+  * @brief  PWM Pulse finished callback in non blocking mode
+  * @param  htim : TIM handle
+  * @retval None
+  */
+void HAL_TIM_PWM_PulseFinishedCallback(TIM_HandleTypeDef *htim)
+{
+	uint32_t slot = TIMER_SLOT(htim);
+	ServoActionDef *srv = (slot < NUM_OF_TIMER ? ChannelMap[slot][htim->Channel] : NULL);
+	if (srv != NULL)
+	{
+		ServoAdvance(srv);
+	}
+}
+#endif
+
+/*****END OF FILE****/
@@ -37,6 +37,7 @@
 #include "stm32f0xx_it.h"
 #include "cmsis_os.h"
 /* USER CODE BEGIN 0 */
+#include "servo.h"
 
 /* USER CODE END 0 */
 /* External variables --------------------------------------------------------*/
@@ -57,11 +58,13 @@ extern UART_HandleTypeDef huart1;
 void TIM2_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM2_IRQn 0 */
-
+#if SERVO_USE_UPDATE_IRQ
+  ServoTimerIRQHandler(&htim2);
+#else
   /* USER CODE END TIM2_IRQn 0 */
   HAL_TIM_IRQHandler(&htim2);
   /* USER CODE BEGIN TIM2_IRQn 1 */
-
+#endif
   /* USER CODE END TIM2_IRQn 1 */
 }
 
@@ -102,11 +105,13 @@ void SysTick_Handler(void)
 void TIM3_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM3_IRQn 0 */
-
+#if SERVO_USE_UPDATE_IRQ
+  ServoTimerIRQHandler(&htim3);
+#else
   /* USER CODE END TIM3_IRQn 0 */
   HAL_TIM_IRQHandler(&htim3);
   /* USER CODE BEGIN TIM3_IRQn 1 */
-
+#endif
   /* USER CODE END TIM3_IRQn 1 */
 }
 
@@ -125,6 +130,14 @@ void EXTI0_1_IRQHandler(void)
 }
 
 /* USER CODE BEGIN 1 */
-
+#if SERVO_USE_DMA_BURST
+/**
+* @brief This function handles DMA1 Channel 2 and Channel 3 interrupts.
+*/
+void DMA1_Channel2_3_IRQHandler(void)
+{
+  ServoDmaIRQHandler();
+}
+#endif
 /* USER CODE END 1 */
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -0,0 +1,226 @@
+/**
+  * COPYRIGHT(c) 2014 Y.Magara
+  */
+
+/* Host test of the CLEAR planner. Build and run with 'make' in this
+   directory. Each case plans the clearing of a stack with PlanClear(),
+   then replays the plan frame by frame the way MotionRun() executes it,
+   and checks that no beam comes closer than the margin to a moving beam
+   above it, and that no beam starts later than with the serial plan. */
+
+#include <stdio.h>
+#include "planner.h"
+
+// positions in 1 us timer steps, as DEG2PULSE() in servo.h
+#define DEG(deg) (1499 + 9 * (deg))
+#define CARD_PUT DEG(45)
+#define CARD_TAKE DEG(-50)
+#define RW_PUT DEG(50)
+#define RW_TAKE DEG(-45)
+
+#define MARGIN 180
+#define VELOCITY 32
+#define ACCELERATION 8
+
+static int failures;
+
+/**
+  * Set up a beam moving from a position to its take position.
+  */
+static void SetBeam(PlanBeamDef *beam, uint32_t position, uint32_t take, uint32_t vmax, uint32_t accel)
+{
+	beam->position = position;
+	beam->profile.start = position;
+	beam->profile.goal = take;
+	beam->profile.vmax = vmax;
+	beam->profile.accel = accel * PROFILE_ACCEL_UNIT;
+	beam->profile.zone = 0;
+	beam->profile.vzone = vmax;
+}
+
+/**
+  * Replay a plan as MotionRun() does.
+  *
+  * @param  start: Receives the frame each beam starts at.
+  * @retval Smallest lead of a moving upper beam over a started lower beam,
+  *         or -1 if the plan did not finish.
+  */
+static int32_t Replay(const PlanBeamDef *beam, uint16_t count, const MotionStepDef *steps, int32_t *start)
+{
+	uint32_t pos[PLAN_MAX_BEAMS];
+	int32_t lead_min = 0x7FFFFFFF;
+	for (uint16_t n = 0; n < count; n++)
+	{
+		pos[n] = beam[n].position;
+		start[n] = -1;
+	}
+	for (int32_t frame = 0; frame < PLAN_MAX_FRAMES; frame++)
+	{
+		for (uint16_t n = 0; n < count; n++)
+		{
+			int16_t after = steps[n].after;
+			if (start[n] >= 0) {
+				continue;
+			}
+			if (after < 0) {
+				start[n] = frame;
+				continue;
+			}
+			const ProfileDef *upper = &beam[after].profile;
+			uint32_t travel = (pos[after] < upper->start ? upper->start - pos[after] : pos[after] - upper->start);
+			if (start[after] >= 0 && (pos[after] == upper->goal || travel >= steps[n].clearance)) {
+				start[n] = frame;
+			}
+		}
+		for (uint16_t j = 1; j < count; j++)
+		{
+			if (start[j] < 0 || beam[j].profile.start == beam[j].profile.goal) {
+				continue;
+			}
+			for (uint16_t i = 0; i < j; i++)
+			{
+				const ProfileDef *upper = &beam[i].profile;
+				if (start[i] < 0 || pos[i] == upper->goal) {
+					continue;
+				}
+				int32_t lead = (upper->goal < upper->start ? (int32_t)pos[j] - (int32_t)pos[i] : (int32_t)pos[i] - (int32_t)pos[j]);
+				if (lead < lead_min) {
+					lead_min = lead;
+				}
+			}
+		}
+		uint8_t moving = 0;
+		uint8_t waiting = 0;
+		for (uint16_t n = 0; n < count; n++)
+		{
+			if (start[n] < 0) {
+				waiting = 1;
+			} else if (pos[n] != beam[n].profile.goal) {
+				pos[n] = ProfileNext(&beam[n].profile, pos[n]);
+				moving = 1;
+			}
+		}
+		if (!moving && !waiting) {
+			return lead_min;
+		}
+	}
+	return -1;
+}
+
+/**
+  * Plan a stack, replay it next to the serial plan and check the result.
+  */
+static void Check(const char *name, const PlanBeamDef *beam, uint16_t count)
+{
+	MotionStepDef plan[PLAN_MAX_BEAMS];
+	MotionStepDef serial[PLAN_MAX_BEAMS];
+	int32_t start[PLAN_MAX_BEAMS];
+	int32_t serial_start[PLAN_MAX_BEAMS];
+	int ok = 1;
+	for (uint16_t n = 0; n < count; n++)
+	{
+		plan[n].index = n;
+		plan[n].goal = beam[n].profile.goal;
+		serial[n] = plan[n];
+		// one beam after another, as CLEAR falls back to
+		serial[n].after = n - 1;
+		serial[n].clearance = CLEARANCE_STOPPED;
+	}
+	PlanClear(beam, count, MARGIN, plan);
+	if (!PlanCheck(beam, count, MARGIN, plan))
+	{
+		printf("%s: PlanCheck rejects the plan\n", name);
+		ok = 0;
+	}
+	int32_t lead = Replay(beam, count, plan, start);
+	if (lead < MARGIN)
+	{
+		printf("%s: lead %ld below margin %d\n", name, (long)lead, MARGIN);
+		ok = 0;
+	}
+	if (Replay(beam, count, serial, serial_start) < 0)
+	{
+		printf("%s: serial plan does not finish\n", name);
+		ok = 0;
+	}
+	for (uint16_t n = 0; n < count; n++)
+	{
+		if (start[n] > serial_start[n])
+		{
+			printf("%s: beam %u starts at frame %ld, serially at %ld\n", name, n, (long)start[n], (long)serial_start[n]);
+			ok = 0;
+		}
+	}
+	printf("%s: %s, starts", name, ok ? "ok" : "FAILED");
+	for (uint16_t n = 0; n < count; n++)
+	{
+		printf(" %ld/%ld", (long)start[n], (long)serial_start[n]);
+	}
+	printf("\n");
+	failures += !ok;
+}
+
+int main(void)
+{
+	PlanBeamDef beam[PLAN_MAX_BEAMS];
+
+	// all cards on the reader
+	SetBeam(&beam[0], RW_PUT, RW_TAKE, VELOCITY, ACCELERATION);
+	for (uint16_t n = 1; n < 5; n++)
+	{
+		SetBeam(&beam[n], CARD_PUT, CARD_TAKE, VELOCITY, ACCELERATION);
+	}
+	Check("full", beam, 5);
+
+	// A and C taken off already, so only B and D are on the stack
+	SetBeam(&beam[1], CARD_TAKE, CARD_TAKE, VELOCITY, ACCELERATION);
+	SetBeam(&beam[3], CARD_TAKE, CARD_TAKE, VELOCITY, ACCELERATION);
+	Check("partial", beam, 5);
+
+	// an arm half way up, as left by an aborted move or a hover
+	SetBeam(&beam[1], DEG(0), CARD_TAKE, VELOCITY, ACCELERATION);
+	Check("partial hover", beam, 5);
+
+	// slow beams above fast ones: the fast ones have to hold back
+	SetBeam(&beam[0], RW_PUT, RW_TAKE, VELOCITY / 4, ACCELERATION / 4);
+	SetBeam(&beam[1], CARD_PUT, CARD_TAKE, VELOCITY / 2, ACCELERATION / 2);
+	SetBeam(&beam[2], CARD_PUT, CARD_TAKE, VELOCITY, ACCELERATION);
+	SetBeam(&beam[3], CARD_PUT, CARD_TAKE, VELOCITY * 2, ACCELERATION * 2);
+	SetBeam(&beam[4], CARD_PUT, CARD_TAKE, VELOCITY * 2, ACCELERATION * 2);
+	Check("mixed slow over fast", beam, 5);
+
+	// fast beams above slow ones
+	SetBeam(&beam[0], RW_PUT, RW_TAKE, VELOCITY * 2, ACCELERATION * 2);
+	SetBeam(&beam[1], CARD_PUT, CARD_TAKE, VELOCITY * 2, ACCELERATION * 2);
+	SetBeam(&beam[2], CARD_PUT, CARD_TAKE, VELOCITY, ACCELERATION);
+	SetBeam(&beam[3], CARD_PUT, CARD_TAKE, VELOCITY / 2, ACCELERATION / 2);
+	SetBeam(&beam[4], CARD_PUT, CARD_TAKE, VELOCITY / 4, ACCELERATION / 4);
+	Check("mixed fast over slow", beam, 5);
+
+	// a fast beam between slow ones, with a card missing
+	SetBeam(&beam[0], RW_PUT, RW_TAKE, VELOCITY / 2, ACCELERATION / 2);
+	SetBeam(&beam[1], CARD_PUT, CARD_TAKE, VELOCITY * 2, ACCELERATION * 2);
+	SetBeam(&beam[2], CARD_TAKE, CARD_TAKE, VELOCITY, ACCELERATION);
+	SetBeam(&beam[3], CARD_PUT, CARD_TAKE, VELOCITY / 4, ACCELERATION / 8);
+	SetBeam(&beam[4], CARD_PUT, CARD_TAKE, VELOCITY, ACCELERATION);
+	Check("mixed partial", beam, 5);
+
+	// a plan starting all beams at once has to be rejected
+	MotionStepDef rush[PLAN_MAX_BEAMS];
+	for (uint16_t n = 0; n < 5; n++)
+	{
+		SetBeam(&beam[n], (n == 0 ? RW_PUT : CARD_PUT), (n == 0 ? RW_TAKE : CARD_TAKE), VELOCITY, ACCELERATION);
+		rush[n].index = n;
+		rush[n].goal = beam[n].profile.goal;
+		rush[n].after = -1;
+		rush[n].clearance = 0;
+	}
+	if (PlanCheck(beam, 5, MARGIN, rush))
+	{
+		printf("rush: PlanCheck accepts crossing beams\n");
+		failures++;
+	}
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return (failures ? 1 : 0);
+}